@@ -1,7 +1,75 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <span>
+#include <sstream>
+#include <stack>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
 
+/**
+ * The assignment's evaluation environment declares the parser, CValue and the capability flags
+ * itself and defines __PROGTEST__. Everywhere else, e.g. in the benchmark build, they come from
+ * the assignment's expression.h, which declares parseExpression and CExprBuilder for
+ * libexpression_parser, and from the declarations below.
+ */
+#ifndef __PROGTEST__
+#include "expression.h"
+
+using CValue = std::variant<std::monostate, double, std::string>;
+
+constexpr unsigned SPREADSHEET_CYCLIC_DEPS = 0x01;
+constexpr unsigned SPREADSHEET_FUNCTIONS = 0x02;
+constexpr unsigned SPREADSHEET_FILE_IO = 0x04;
+constexpr unsigned SPREADSHEET_SPEED = 0x08;
+constexpr unsigned SPREADSHEET_PARSER = 0x10;
+#endif /* __PROGTEST__ */
+
+/**
+ * Defining SPREADSHEET_PROFILE makes the sheet count what its evaluation does, see
+ * CSpreadsheet::profile. Without it the counters and everything updating them compile to nothing.
+ */
+#ifdef SPREADSHEET_PROFILE
+#define PROFILE_ONLY(...) __VA_ARGS__
+#define PROFILE_COUNT(counter, amount) ((counter).fetch_add((amount), std::memory_order_relaxed))
+#else
+#define PROFILE_ONLY(...)
+#define PROFILE_COUNT(counter, amount) ((void)0)
+#endif
 
 /**
  * @brief Class for representing a position in a table.
+ *
+ * The position is packed into two 32-bit numbers, the column name is only formatted on demand.
  */
 class CPos {
 public:
@@ -18,13 +86,23 @@ public:
      */
     CPos(std::string_view str);
 
+    /**
+     * @brief Constructor using the column and row numbers.
+     *
+     * @param column Column number, 1 is column A.
+     * @param row Row number.
+     * @throw std::invalid_argument If the column or row does not fit into 32 bits.
+     */
+    CPos(long long column, long long row);
+
     /**
      * @brief Overloaded addition operator.
      *
      * @param offset Offset as a pair (column, row).
      * @return New position considering the offset.
+     * @throw std::invalid_argument If the new column or row does not fit into 32 bits.
      */
-    CPos operator+(std::pair<long long, long long> &offset) const;
+    CPos operator+(const std::pair<long long, long long> &offset) const;
 
     /**
      * @brief Get the string representation of the column.
@@ -55,6 +133,27 @@ public:
      */
     bool operator==(const CPos& other) const;
 
+    /**
+     * @brief Get the position as a single number ordered by column first and row second.
+     *
+     * @return Key of the position.
+     */
+    uint64_t getKey() const;
+
+    /**
+     * @brief Append the position in the "A1" notation to a string.
+     *
+     * @param out String to append to.
+     */
+    void appendTo(std::string &out) const;
+
+    /**
+     * @brief Append the letters of the column to a string.
+     *
+     * @param out String to append to.
+     */
+    void appendColumnTo(std::string &out) const;
+
 private:
     /**
      * @brief Convert a string to a number.
@@ -71,11 +170,12 @@ private:
      */
     std::string numberToString() const;
 
-    std::string m_columnStr; ///< String representation of the column.
-    long long m_column;      ///< Column number.
-    long long m_row;         ///< Row number.
+    int32_t m_column;      ///< Column number.
+    int32_t m_row;         ///< Row number.
 };
 
+static_assert(std::is_trivially_copyable_v<CPos> && sizeof(CPos) == 8, "CPos has to stay a packed value");
+
 /**
  * @brief Struct for comparing positions.
  */
@@ -95,31 +195,40 @@ CPos::CPos() : m_column(0), m_row(0) {}
 
 CPos::CPos(std::string_view str) {
     size_t splitPos = 0;
+    std::string columnStr;
 
     while(splitPos < str.length() && std::isalpha(str[splitPos])) {
-        m_columnStr.push_back(std::toupper(str[splitPos++]));
+        columnStr.push_back(std::toupper(str[splitPos++]));
     }
 
     if(splitPos == 0 || splitPos == str.length()) {
         throw std::invalid_argument("Invalid cell identifier.");
     }
 
+    // The view does not have to be terminated, load passes views into its read buffer.
+    std::string rowStr(str.substr(splitPos));
     size_t check = 0;
-    m_row = std::stoi(str.substr(splitPos).data(), &check);
+    m_row = std::stoi(rowStr, &check);
+
+    if(check != rowStr.length()) {
+        throw std::invalid_argument("Invalid cell identifier.");
+    }
 
-    if(check != str.substr(splitPos).length()) {
+    auto column = stringToNumber(columnStr);
+    if(column > INT32_MAX) {
         throw std::invalid_argument("Invalid cell identifier.");
     }
+    m_column = static_cast<int32_t>(column);
+}
 
-    m_column = stringToNumber(m_columnStr);
+CPos::CPos(long long column, long long row) : m_column(static_cast<int32_t>(column)), m_row(static_cast<int32_t>(row)) {
+    if(m_column != column || m_row != row) {
+        throw std::invalid_argument("Invalid cell identifier.");
+    }
 }
 
-CPos CPos::operator+(std::pair<long long, long long> &offset) const {
-    CPos off;
-    off.m_row = m_row + offset.second;
-    off.m_column = m_column + offset.first;
-    off.m_columnStr = numberToString();
-    return off;
+CPos CPos::operator+(const std::pair<long long, long long> &offset) const {
+    return CPos(m_column + offset.first, m_row + offset.second);
 }
 
 std::string CPos::getColumnStr() const {
@@ -138,6 +247,11 @@ bool CPos::operator==(const CPos& other) const {
     return m_column == other.m_column && m_row == other.m_row;
 }
 
+uint64_t CPos::getKey() const {
+    // Flipping the sign bits orders negative numbers before positive ones.
+    return (static_cast<uint64_t>(static_cast<uint32_t>(m_column) ^ 0x80000000u) << 32) | (static_cast<uint32_t>(m_row) ^ 0x80000000u);
+}
+
 long long CPos::stringToNumber(const std::string& str) const {
     long long result = 0;
     for (char ch : str) {
@@ -145,6 +259,9 @@ long long CPos::stringToNumber(const std::string& str) const {
             result *= 26;
             result += ch - 'A' + 1;
         }
+        if (result > INT32_MAX) {
+            break;
+        }
     }
     return result;
 }
@@ -161,1283 +278,5959 @@ std::string CPos::numberToString() const {
     return result;
 }
 
-bool CPosComparator::operator()(const CPos& lhs, const CPos& rhs) const {
-    if (lhs.getColumn() != rhs.getColumn()) {
-        return lhs.getColumn() < rhs.getColumn();
+void CPos::appendTo(std::string &out) const {
+    appendColumnTo(out);
+    char row[16];
+    auto written = std::to_chars(row, row + sizeof(row), m_row).ptr;
+    out.append(row, written);
+}
+
+void CPos::appendColumnTo(std::string &out) const {
+    char column[8];
+    auto end = column + sizeof(column), begin = end;
+    for (auto num = m_column; num > 0; num = (num - 1) / 26) {
+        *--begin = static_cast<char>('A' + (num - 1) % 26);
     }
-    return lhs.getRow() < rhs.getRow();
+    out.append(begin, end);
+}
+
+bool CPosComparator::operator()(const CPos& lhs, const CPos& rhs) const {
+    return lhs.getKey() < rhs.getKey();
 }
 
 
 /**
- * @brief Base class representing a node in the abstract syntax tree (AST).
+ * @brief Fixed set of worker threads running index ranges in parallel.
+ *
+ * Each participant (the workers and the calling thread) owns a queue of ranges. It takes
+ * work from the back of its own queue and steals from the front of the other queues once
+ * its own runs dry, so uneven ranges balance out between the threads.
  */
-struct ASTNode {
+class CWorkerPool
+{
+public:
     /**
-     * @brief Constructor for ASTNode.
+     * @brief Start the pool.
      *
-     * @param l Pointer to the left child node.
-     * @param r Pointer to the right child node.
-     * @param isExp Flag indicating whether the node represents an expression.
+     * @param threads Number of threads evaluating in parallel, including the calling thread.
      */
-    ASTNode(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r, bool isExp = false) : m_left(l), m_right(r), isExpression(isExp){}
+    explicit CWorkerPool(unsigned threads);
 
     /**
-     * @brief Virtual destructor for ASTNode.
+     * @brief Stop and join all worker threads.
      */
-    virtual ~ASTNode() = default;
+    ~CWorkerPool();
 
-    /**
-     * @brief Evaluate the node and return the result.
-     *
-     * @return The result of the evaluation.
-     */
-    virtual CValue evaluate() = 0;
+    CWorkerPool(const CWorkerPool &) = delete;
+    CWorkerPool &operator=(const CWorkerPool &) = delete;
 
     /**
-     * @brief Create a deep copy of the node and its children.
+     * @brief Get the number of threads evaluating in parallel, including the calling thread.
      *
-     * @param map Map of positions to nodes for keeping track of copied nodes.
-     * @return A pointer to the deep copy of the node.
+     * @return Number of threads.
      */
-    virtual std::shared_ptr<ASTNode> deepCopy(std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator>& map) const = 0;
+    unsigned size() const;
 
     /**
-     * @brief Move the node and its children relative to their positions.
+     * @brief Run body over the indices [0, count) and wait until all of them are done.
      *
-     * @param offset Pair of offsets to move the node.
+     * @param count Number of indices.
+     * @param body Function called with half-open index ranges [begin, end), possibly from several threads at once.
      */
-    virtual void moveRelativelyBy(const std::pair<long long int, long long int>& offset) = 0;
+    void parallelFor(size_t count, const std::function<void(size_t, size_t)> &body);
 
-    /**
-     * @brief Print the node.
-     *
-     * @param os Output stream to print the node.
-     */
-    virtual void print(std::ostream& os) const = 0;
+private:
+    struct CQueue
+    {
+        std::mutex m_mutex;
+        std::deque<std::pair<size_t, size_t>> m_ranges;
+    };
 
     /**
-     * @brief Check if the node or any of its children forms a cycle.
+     * @brief Take one range from the own queue or steal one from another queue and run it.
      *
-     * @param visited Map of positions to booleans to keep track of visited nodes.
-     * @return True if a cycle is detected, otherwise false.
+     * @param id Index of the queue owned by the calling participant.
+     * @return True if a range was run, false if all queues are empty.
      */
-    virtual bool hasCycle(std::map<CPos, bool, CPosComparator>& visited) const = 0;
+    bool runOne(unsigned id);
+
+    void workerLoop(unsigned id);
+
+    std::vector<std::unique_ptr<CQueue>> m_queues; ///< One queue per participant, the calling thread owns the last one.
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void(size_t, size_t)> *m_body = nullptr;
+    std::atomic<size_t> m_remaining {0}; ///< Number of ranges of the current job that have not finished yet.
+    unsigned long long m_job = 0; ///< Sequence number of the current job, workers wake up when it changes.
+    bool m_stop = false;
+};
 
-    /**
-     * @brief Overloaded output stream operator to print the node.
-     *
-     * @param os Output stream.
-     * @param node Node to be printed.
-     * @return Reference to the output stream.
-     */
-    friend std::ostream& operator<<(std::ostream& os, const ASTNode& node)
+
+CWorkerPool::CWorkerPool(unsigned threads)
+{
+    threads = std::max(threads, 1u);
+    for(unsigned i = 0; i < threads; i++)
+        m_queues.push_back(std::make_unique<CQueue>());
+    for(unsigned i = 0; i + 1 < threads; i++)
+        m_threads.emplace_back(&CWorkerPool::workerLoop, this, i);
+}
+
+CWorkerPool::~CWorkerPool()
+{
     {
-        node.print(os);
-        return os;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
     }
+    m_wake.notify_all();
+    for(auto &thread : m_threads)
+        thread.join();
+}
 
-    std::shared_ptr<ASTNode> m_left; ///< Pointer to the left child node.
-    std::shared_ptr<ASTNode> m_right; ///< Pointer to the right child node.
-    bool isExpression; ///< Flag indicating whether the node represents an expression.
-};
+unsigned CWorkerPool::size() const
+{
+    return m_queues.size();
+}
+
+void CWorkerPool::parallelFor(size_t count, const std::function<void(size_t, size_t)> &body)
+{
+    if(count == 0)
+        return;
+
+    // A few ranges per thread, so threads that finish early have something left to steal.
+    size_t chunk = std::max<size_t>(1, count / (size() * 4));
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_body = &body;
+        m_remaining = (count + chunk - 1) / chunk;
+    }
+    for(size_t begin = 0, queue = 0; begin < count; begin += chunk, queue = (queue + 1) % size())
+    {
+        std::lock_guard<std::mutex> lock(m_queues[queue]->m_mutex);
+        m_queues[queue]->m_ranges.emplace_back(begin, std::min(count, begin + chunk));
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_job++;
+    }
+    m_wake.notify_all();
+
+    while(runOne(size() - 1)) {}
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_remaining == 0; });
+    m_body = nullptr;
+}
+
+bool CWorkerPool::runOne(unsigned id)
+{
+    std::pair<size_t, size_t> range;
+    bool found = false;
+    for(unsigned i = 0; i < size() && !found; i++)
+    {
+        auto &queue = *m_queues[(id + i) % size()];
+        std::lock_guard<std::mutex> lock(queue.m_mutex);
+        if(queue.m_ranges.empty())
+            continue;
+        if(i == 0)
+        {
+            range = queue.m_ranges.back();
+            queue.m_ranges.pop_back();
+        }
+        else
+        {
+            range = queue.m_ranges.front();
+            queue.m_ranges.pop_front();
+        }
+        found = true;
+    }
+    if(!found)
+        return false;
 
+    (*m_body)(range.first, range.second);
+    if(--m_remaining == 0)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done.notify_all();
+    }
+    return true;
+}
+
+void CWorkerPool::workerLoop(unsigned id)
+{
+    unsigned long long seen = 0;
+    while(true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this, seen] { return m_stop || m_job != seen; });
+            if(m_stop)
+                return;
+            seen = m_job;
+        }
+        while(runOne(id)) {}
+    }
+}
 
 
 /**
- * @brief Class representing a binary arithmetic operator node in the abstract syntax tree (AST).
+ * @brief Bump allocator for objects that are all released together.
  *
- * This class represents a binary arithmetic operator node in the AST.
- * It inherits from the ASTNode class and provides common functionalities for binary arithmetic operators.
+ * Objects are placed one after another into large blocks. Releasing them runs the pending
+ * destructors and rewinds the blocks, which are kept and reused by the next allocations.
  */
-struct ASTNodeBinaryOperator : public ASTNode {
+class CArena
+{
+public:
+    CArena() = default;
+
     /**
-     * @brief Constructor for ASTNodeBinaryOperator.
-     *
-     * @param op The operator symbol.
-     * @param l Pointer to the left child node.
-     * @param r Pointer to the right child node.
+     * @brief Destroy all objects and free the blocks.
      */
-    ASTNodeBinaryOperator(const std::string &op, std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
+    ~CArena();
+
+    CArena(const CArena &) = delete;
+    CArena &operator=(const CArena &) = delete;
 
     /**
-     * @brief Move the binary operator node and its children relative to their positions.
+     * @brief Construct an object inside the arena.
      *
-     * @param offset Pair of offsets to move the node.
+     * @param args Arguments forwarded to the constructor.
+     * @return Pointer to the object, valid until clear is called.
+     */
+    template <typename T, typename ... Args>
+    T *make(Args && ... args)
+    {
+        T *object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        PROFILE_ONLY(m_made++;)
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            m_destructors.push_back({object, [](void *ptr) { static_cast<T *>(ptr)->~T(); }});
+        return object;
+    }
+
+    /**
+     * @brief Destroy all objects at once and keep the memory for reuse.
      */
-    void moveRelativelyBy(const std::pair<long long int, long long int> &offset) override;
+    void clear();
 
+#ifdef SPREADSHEET_PROFILE
     /**
-     * @brief Print the binary operator node.
+     * @brief Get the number of objects constructed so far, including the ones already destroyed by clear.
      *
-     * @param os Output stream to print the node.
+     * @return The number of objects.
      */
-    void print(std::ostream &os) const override;
+    size_t made() const { return m_made; }
+#endif
+
+    static constexpr size_t BLOCK_SIZE = 16384; ///< Size of a regular block in bytes.
+
+private:
+    struct CBlock
+    {
+        std::unique_ptr<unsigned char[]> m_data;
+        size_t m_size;
+    };
 
     /**
-     * @brief Check if the binary operator node or any of its children forms a cycle.
+     * @brief Reserve uninitialized memory.
      *
-     * @param visited Map of positions to booleans to keep track of visited nodes.
-     * @return True if a cycle is detected, otherwise false.
+     * @param size Number of bytes.
+     * @param align Required alignment, at most alignof(std::max_align_t).
+     * @return Pointer to the memory.
      */
-    bool hasCycle(std::map<CPos, bool, CPosComparator> &visited) const override;
+    void *allocate(size_t size, size_t align);
 
-    std::string m_op; /**< The operator symbol. */
+    std::vector<CBlock> m_blocks;
+    size_t m_current = 0; ///< Index of the block allocations are served from.
+    size_t m_used = 0; ///< Number of bytes used in the current block.
+    std::vector<std::pair<void *, void (*)(void *)>> m_destructors; ///< Objects to destroy on clear, in construction order.
+    PROFILE_ONLY(size_t m_made = 0;) ///< Number of objects constructed so far.
 };
 
 
-ASTNodeBinaryOperator::ASTNodeBinaryOperator(const std::string &op, std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNode(l, r), m_op(op){}
-
+CArena::~CArena()
+{
+    clear();
+}
 
-    void ASTNodeBinaryOperator:: moveRelativelyBy(const std::pair<long long int, long long int> &offset)
-    {
-        m_left->moveRelativelyBy(offset);
-        m_right->moveRelativelyBy(offset);
-    }
+void CArena::clear()
+{
+    for(auto it = m_destructors.rbegin(); it != m_destructors.rend(); ++it)
+        it->second(it->first);
+    m_destructors.clear();
+    m_current = 0;
+    m_used = 0;
+}
 
-    void ASTNodeBinaryOperator::print(std::ostream &os) const
-    {
-        os <<"(";
-        m_left->print(os);
-        os << m_op;
-        m_right->print(os);
-        os <<")";
-    }
-    bool ASTNodeBinaryOperator::hasCycle(std::map<CPos, bool, CPosComparator> &visited) const
+void *CArena::allocate(size_t size, size_t align)
+{
+    while(m_current < m_blocks.size())
     {
-        return (m_left->hasCycle(visited) || m_right->hasCycle(visited));
+        auto &block = m_blocks[m_current];
+        size_t offset = (m_used + align - 1) & ~(align - 1);
+        if(offset + size <= block.m_size)
+        {
+            m_used = offset + size;
+            return block.m_data.get() + offset;
+        }
+        m_current++;
+        m_used = 0;
     }
+    size_t blockSize = std::max(BLOCK_SIZE, size);
+    m_blocks.push_back({std::make_unique<unsigned char[]>(blockSize), blockSize});
+    m_current = m_blocks.size() - 1;
+    m_used = size;
+    return m_blocks.back().m_data.get();
+}
 
 
+struct CCells;
 
-struct ASTNodeRelationalOperator : public ASTNode {
+/**
+ * @brief Rectangle of cells given by two opposite corners, both inclusive.
+ */
+struct CRange
+{
+    /**
+     * @brief Constructor from any two opposite corners.
+     *
+     * @param a First corner.
+     * @param b Opposite corner.
+     */
+    CRange(const CPos &a, const CPos &b);
 
-    ASTNodeRelationalOperator(const std::string &op, std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
+    /**
+     * @brief Check whether the position lies inside the rectangle.
+     *
+     * @param pos Position to check.
+     * @return True if pos is inside.
+     */
+    bool contains(const CPos &pos) const;
 
-    void moveRelativelyBy(const std::pair<long long int, long long int> &offset) override;
+    /**
+     * @brief Check whether the rectangles share a position.
+     *
+     * @param other The other rectangle.
+     * @return True if they overlap.
+     */
+    bool overlaps(const CRange &other) const;
 
-    void print(std::ostream &os) const override;
+    bool operator==(const CRange &other) const;
 
-    bool hasCycle(std::map<CPos, bool, CPosComparator> &visited) const override;
+    bool operator<(const CRange &other) const;
 
-    std::string m_op;
+    CPos m_from; ///< Corner with the lowest column and row.
+    CPos m_to;   ///< Corner with the highest column and row.
 };
 
 
-ASTNodeRelationalOperator::ASTNodeRelationalOperator(const std::string &op, std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNode(l, r), m_op(op){}
-
+CRange::CRange(const CPos &a, const CPos &b) :
+        m_from(std::min(a.getColumn(), b.getColumn()), std::min(a.getRow(), b.getRow())),
+        m_to(std::max(a.getColumn(), b.getColumn()), std::max(a.getRow(), b.getRow())) {}
 
-void ASTNodeRelationalOperator:: moveRelativelyBy(const std::pair<long long int, long long int> &offset)
+bool CRange::contains(const CPos &pos) const
 {
-    m_left->moveRelativelyBy(offset);
-    m_right->moveRelativelyBy(offset);
+    return pos.getColumn() >= m_from.getColumn() && pos.getColumn() <= m_to.getColumn()
+           && pos.getRow() >= m_from.getRow() && pos.getRow() <= m_to.getRow();
 }
 
-void ASTNodeRelationalOperator::print(std::ostream &os) const
+bool CRange::overlaps(const CRange &other) const
 {
-    os <<"(";
-    m_left->print(os);
-    os << m_op;
-    m_right->print(os);
-    os <<")";
+    return m_from.getColumn() <= other.m_to.getColumn() && other.m_from.getColumn() <= m_to.getColumn()
+           && m_from.getRow() <= other.m_to.getRow() && other.m_from.getRow() <= m_to.getRow();
 }
-bool ASTNodeRelationalOperator::hasCycle(std::map<CPos, bool, CPosComparator> &visited) const
+
+bool CRange::operator==(const CRange &other) const
 {
-    return (m_left->hasCycle(visited) || m_right->hasCycle(visited));
+    return m_from == other.m_from && m_to == other.m_to;
 }
 
-
-struct ASTNodeUnaryOperator : public ASTNode
+bool CRange::operator<(const CRange &other) const
 {
-    ASTNodeUnaryOperator(const std::string & op, std::shared_ptr<ASTNode> l);
+    if(!(m_from == other.m_from))
+        return m_from.getKey() < other.m_from.getKey();
+    return m_to.getKey() < other.m_to.getKey();
+}
 
-    void moveRelativelyBy(const std::pair<long long int, long long int> &offset) override;
 
-    void print(std::ostream &os) const override;
+/**
+ * @brief Insertion or deletion of whole rows or columns, which moves every cell behind them.
+ */
+struct CShift
+{
+    /**
+     * @brief Get the position a cell moves to.
+     *
+     * @param pos Position of the cell before the change.
+     * @return Position of the cell after the change, nothing if the cell is deleted.
+     */
+    std::optional<CPos> map(const CPos &pos) const;
 
-    bool hasCycle(std::map<CPos, bool, CPosComparator> &visited) const override;
+    /**
+     * @brief Get what a range becomes, cells inserted inside it extend it and deleted cells shrink it.
+     *
+     * @param range The range before the change.
+     * @return The range after the change, nothing if all its cells are deleted.
+     */
+    std::optional<CRange> map(const CRange &range) const;
 
-    std::string m_op;
-};
+    /**
+     * @brief Check whether any cell of a range is deleted.
+     *
+     * @param range The range.
+     * @return True if a cell is deleted.
+     */
+    bool deletes(const CRange &range) const;
 
+    /**
+     * @brief Get the range of all positions the change moves or deletes.
+     *
+     * @return Every position from m_at on along the shifted axis.
+     */
+    CRange area() const;
 
-ASTNodeUnaryOperator::ASTNodeUnaryOperator(const std::string & op, std::shared_ptr<ASTNode> l) : ASTNode(l, nullptr), m_op(op){}
+    /**
+     * @brief Get the coordinate of a position along the shifted axis.
+     *
+     * @param pos The position.
+     * @return Its column for columns, its row for rows.
+     */
+    long long coordinate(const CPos &pos) const;
 
-    void ASTNodeUnaryOperator::moveRelativelyBy(const std::pair<long long int, long long int> &offset)
-    {
-        m_left->moveRelativelyBy(offset);
-    }
+    /**
+     * @brief Replace the coordinate of a position along the shifted axis.
+     *
+     * @param pos The position.
+     * @param value The new coordinate.
+     * @return The position with the new coordinate.
+     */
+    CPos withCoordinate(const CPos &pos, long long value) const;
 
-    void ASTNodeUnaryOperator::print(std::ostream &os) const
-    {
-        os <<"(-";
-        m_left->print(os);
-        os <<")";
-    }
+    bool m_columns;    ///< True if columns are inserted or deleted, false for rows.
+    long long m_at;    ///< First inserted or deleted column or row.
+    long long m_count; ///< Number of inserted columns or rows, negative for deleted ones.
+};
 
-    bool ASTNodeUnaryOperator :: hasCycle(std::map<CPos, bool, CPosComparator> &visited) const
-    {
-        return (m_left->hasCycle(visited));
-    }
 
-struct ASTNodeAdd : public ASTNodeBinaryOperator
+std::optional<CPos> CShift::map(const CPos &pos) const
 {
+    auto value = coordinate(pos);
+    if(value < m_at)
+        return pos;
+    if(m_count < 0 && value < m_at - m_count)
+        return std::nullopt;
+    return withCoordinate(pos, value + m_count);
+}
 
-    ASTNodeAdd(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
+std::optional<CRange> CShift::map(const CRange &range) const
+{
+    auto low = coordinate(range.m_from), high = coordinate(range.m_to);
+    if(m_count > 0)
+        return CRange(withCoordinate(range.m_from, low >= m_at ? low + m_count : low),
+                      withCoordinate(range.m_to, high >= m_at ? high + m_count : high));
+
+    // Deleted cells at the edges are cut off, the rest of the range closes the gap.
+    auto end = m_at - m_count;
+    auto newLow = low < m_at ? low : (low >= end ? low + m_count : m_at);
+    auto newHigh = high < m_at ? high : (high >= end ? high + m_count : m_at - 1);
+    if(newLow > newHigh)
+        return std::nullopt;
+    return CRange(withCoordinate(range.m_from, newLow), withCoordinate(range.m_to, newHigh));
+}
 
-    CValue evaluate() override;
+bool CShift::deletes(const CRange &range) const
+{
+    return m_count < 0 && coordinate(range.m_from) < m_at - m_count && coordinate(range.m_to) >= m_at;
+}
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+CRange CShift::area() const
+{
+    constexpr auto last = std::numeric_limits<int32_t>::max();
+    return CRange(withCoordinate(CPos(0, 0), m_at), withCoordinate(CPos(last, last), last));
+}
 
-};
+long long CShift::coordinate(const CPos &pos) const
+{
+    return m_columns ? pos.getColumn() : pos.getRow();
+}
 
-struct ASTNodeSub : public ASTNodeBinaryOperator
+CPos CShift::withCoordinate(const CPos &pos, long long value) const
 {
+    return m_columns ? CPos(value, pos.getRow()) : CPos(pos.getColumn(), value);
+}
 
-    ASTNodeSub(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
 
-    CValue evaluate() override;
+/**
+ * @brief Appends values in the binary sheet format to a byte buffer.
+ *
+ * Numbers are stored little endian regardless of the platform, doubles by their IEEE 754 bits.
+ */
+class CBinaryWriter
+{
+public:
+    void writeByte(uint8_t value);
+    void writeU32(uint32_t value);
+    void writeI32(int32_t value);
+    void writeU64(uint64_t value);
+    void writeDouble(double value);
+    void writeString(const std::string &value);
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+    /**
+     * @brief Get the bytes written so far.
+     *
+     * @return The buffer.
+     */
+    const std::string &data() const;
 
+private:
+    std::string m_data;
 };
 
-struct ASTNodeMul : public ASTNodeBinaryOperator
+/**
+ * @brief Reads values written by CBinaryWriter from a byte buffer.
+ *
+ * Every read checks the end of the buffer, so truncated or corrupted input is reported
+ * instead of being read past.
+ */
+class CBinaryReader
 {
+public:
+    CBinaryReader(const char *begin, const char *end);
 
-    ASTNodeMul(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
+    /**
+     * @throw std::invalid_argument If the buffer ends before the value.
+     */
+    uint8_t readByte();
+    uint32_t readU32();
+    int32_t readI32();
+    uint64_t readU64();
+    double readDouble();
+    std::string readString();
 
-    CValue evaluate() override;
+    /**
+     * @brief Check whether the whole buffer has been read.
+     *
+     * @return True if there is nothing left.
+     */
+    bool atEnd() const;
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+private:
+    /**
+     * @brief Consume the given number of bytes.
+     *
+     * @param size Number of bytes.
+     * @return Pointer to the first of them.
+     * @throw std::invalid_argument If there are not enough bytes left.
+     */
+    const char *take(size_t size);
 
+    const char *m_current;
+    const char *m_end;
 };
 
-struct ASTNodeDiv : public ASTNodeBinaryOperator
+void CBinaryWriter::writeByte(uint8_t value)
 {
+    m_data.push_back(static_cast<char>(value));
+}
 
-    ASTNodeDiv(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
-
-    CValue evaluate() override;
+void CBinaryWriter::writeU32(uint32_t value)
+{
+    for(int shift = 0; shift < 32; shift += 8)
+        writeByte(static_cast<uint8_t>(value >> shift));
+}
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+void CBinaryWriter::writeI32(int32_t value)
+{
+    writeU32(static_cast<uint32_t>(value));
+}
 
-};
+void CBinaryWriter::writeU64(uint64_t value)
+{
+    for(int shift = 0; shift < 64; shift += 8)
+        writeByte(static_cast<uint8_t>(value >> shift));
+}
 
-struct ASTNodePow : public ASTNodeBinaryOperator
+void CBinaryWriter::writeDouble(double value)
 {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    writeU64(bits);
+}
 
-    ASTNodePow(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
+void CBinaryWriter::writeString(const std::string &value)
+{
+    writeU32(static_cast<uint32_t>(value.size()));
+    m_data += value;
+}
 
-    CValue evaluate() override;
+const std::string &CBinaryWriter::data() const
+{
+    return m_data;
+}
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+CBinaryReader::CBinaryReader(const char *begin, const char *end) : m_current(begin), m_end(end) {}
 
-};
+const char *CBinaryReader::take(size_t size)
+{
+    if(static_cast<size_t>(m_end - m_current) < size)
+        throw std::invalid_argument("Truncated binary sheet");
+    auto result = m_current;
+    m_current += size;
+    return result;
+}
 
+uint8_t CBinaryReader::readByte()
+{
+    return static_cast<uint8_t>(*take(1));
+}
 
+uint32_t CBinaryReader::readU32()
+{
+    auto bytes = take(4);
+    uint32_t result = 0;
+    for(int i = 0; i < 4; i++)
+        result |= static_cast<uint32_t>(static_cast<uint8_t>(bytes[i])) << (8 * i);
+    return result;
+}
 
-struct ASTNodeEq : public ASTNodeRelationalOperator
+int32_t CBinaryReader::readI32()
 {
+    return static_cast<int32_t>(readU32());
+}
 
-    ASTNodeEq(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
+uint64_t CBinaryReader::readU64()
+{
+    auto bytes = take(8);
+    uint64_t result = 0;
+    for(int i = 0; i < 8; i++)
+        result |= static_cast<uint64_t>(static_cast<uint8_t>(bytes[i])) << (8 * i);
+    return result;
+}
 
-    CValue evaluate() override;
+double CBinaryReader::readDouble()
+{
+    auto bits = readU64();
+    double result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
-
-};
-
-struct ASTNodeNe : public ASTNodeRelationalOperator
-{
-
-    ASTNodeNe(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
-
-    CValue evaluate() override;
-
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
-
-};
-
-struct ASTNodeLt : public ASTNodeRelationalOperator
-{
-
-    ASTNodeLt(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
-
-    CValue evaluate() override;
-
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
-
-};
-
-struct ASTNodeLe : public ASTNodeRelationalOperator
+std::string CBinaryReader::readString()
 {
+    auto size = readU32();
+    auto bytes = take(size);
+    return std::string(bytes, size);
+}
 
-    ASTNodeLe(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
-
-    CValue evaluate() override;
-
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
-
-};
-
-struct ASTNodeGt : public ASTNodeRelationalOperator
+bool CBinaryReader::atEnd() const
 {
+    return m_current == m_end;
+}
 
-    ASTNodeGt(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
-
-    CValue evaluate() override;
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+/**
+ * @brief Immutable string shared by all values holding it.
+ */
+using CString = std::shared_ptr<const std::string>;
 
-};
+/**
+ * @brief Value used while evaluating and cached in cells, like CValue but strings are shared.
+ *
+ * Reading a string cell or a string literal only takes another reference, the text is copied just
+ * once into a CValue when getValue returns it.
+ */
+using CCellValue = std::variant<std::monostate, double, CString>;
 
-struct ASTNodeGe : public ASTNodeRelationalOperator
+/**
+ * @brief Convert a shared value into the value returned to the user.
+ *
+ * @param value The value.
+ * @return Copy of the value.
+ */
+CValue toValue(const CCellValue &value)
 {
+    if(auto number = std::get_if<double>(&value))
+        return *number;
+    if(auto text = std::get_if<CString>(&value))
+        return **text;
+    return CValue {};
+}
 
-    ASTNodeGe(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r);
-
-    CValue evaluate() override;
-
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
-
-};
-
-
-
-struct ASTNodeNeg : public ASTNodeUnaryOperator
+/**
+ * @brief Formula compiled into postfix code for a small stack machine.
+ *
+ * The code of a formula is stored contiguously together with the string literals and the
+ * references it uses, so evaluating it is a single loop over a flat array with no virtual
+ * calls and no pointer chasing. Ranges are only allowed as function arguments and are never
+ * pushed, the function reads the cells of the range directly.
+ *
+ * Once built, a formula is converted by toRelative so that it no longer depends on the cell it is
+ * stored in. The same formula is then shared by every cell with the same contents relative to its
+ * position, e.g. all cells of a column filled down with =A1*2, and the position of the cell is
+ * passed to every operation that needs absolute coordinates.
+ */
+struct CFormula
 {
-    ASTNodeNeg(std::shared_ptr<ASTNode> l);
-
-    CValue evaluate() override;
-
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+    /**
+     * @brief Operation performed by a single instruction.
+     */
+    enum EOpCode : unsigned char
+    {
+        OP_NUMBER,    ///< Push m_number.
+        OP_STRING,    ///< Push the string literal m_arg.
+        OP_REFERENCE, ///< Push the value of the cell referenced by reference m_arg.
+        OP_ADD,
+        OP_SUB,
+        OP_MUL,
+        OP_DIV,
+        OP_POW,
+        OP_NEG,
+        OP_EQ,
+        OP_NE,
+        OP_LT,
+        OP_LE,
+        OP_GT,
+        OP_GE,
+        OP_CALL       ///< Call function m_arg, replacing its arguments on the stack with the result.
+    };
 
-};
+    /**
+     * @brief Built-in aggregate function.
+     */
+    enum EFunction : unsigned char
+    {
+        FN_SUM,     ///< Sum of the numbers, empty if there are none.
+        FN_AVERAGE, ///< Average of the numbers, empty if there are none.
+        FN_MIN,     ///< Smallest number, empty if there are none.
+        FN_MAX,     ///< Largest number, empty if there are none.
+        FN_COUNT,   ///< Number of numbers.
+        FN_COUNT_OF
+    };
 
+    /**
+     * @brief Single instruction of the postfix code.
+     */
+    struct CInstruction
+    {
+        EOpCode m_op;
+        unsigned m_arg = 0;   ///< Index into m_strings or m_references.
+        double m_number = 0;  ///< Operand of OP_NUMBER.
+    };
 
+    /**
+     * @brief Cell referenced by the formula.
+     */
+    struct CReference
+    {
+        bool operator==(const CReference &other) const;
 
-struct ASTStringLiteral: public ASTNode
-{
-    ASTStringLiteral(const std::string &literal, bool isExp);
+        CPos m_pos; ///< Position of the cell, components not fixed by '$' are relative to the formula's cell after toRelative.
+        bool m_absoluteColumn; ///< The column is prefixed with '$' and stays fixed when the formula is copied.
+        bool m_absoluteRow;    ///< The row is prefixed with '$' and stays fixed when the formula is copied.
+    };
 
-    CValue evaluate () override;
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos,std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
-    void moveRelativelyBy(const std::pair<long long int, long long int> &offset) override;
+    /**
+     * @brief Range referenced by the formula, the corners are kept as written.
+     */
+    struct CRangeReference
+    {
+        bool operator==(const CRangeReference &other) const;
 
-    void print(std::ostream &os) const override;
-    bool hasCycle(std::map<CPos, bool, CPosComparator> &visited) const override;
-private:
-    std::string m_literal;
-};
+        CReference m_from;
+        CReference m_to;
+    };
 
+    /**
+     * @brief Function call with the kinds of its arguments.
+     */
+    struct CCall
+    {
+        bool operator==(const CCall &other) const;
 
+        EFunction m_function;
+        std::vector<int> m_arguments; ///< Index into m_ranges for range arguments, -1 for values taken from the stack.
+    };
 
+    /**
+     * @brief Get the function with the given name.
+     *
+     * @param name Name of the function, case insensitive.
+     * @return The function.
+     * @throw std::invalid_argument If there is no such function.
+     */
+    static EFunction findFunction(const std::string &name);
 
-struct ASTNodeDouble: public ASTNode
-{
+    /**
+     * @brief Append an operator instruction.
+     *
+     * @param op The operation.
+     */
+    void emit(EOpCode op);
 
-    ASTNodeDouble(double value);
+    /**
+     * @brief Append an instruction pushing a number.
+     *
+     * @param value The number.
+     */
+    void emitNumber(double value);
 
-    CValue evaluate() override;
+    /**
+     * @brief Append an instruction pushing a string literal.
+     *
+     * @param literal The string.
+     */
+    void emitString(const std::string &literal);
 
-    std::shared_ptr<ASTNode> deepCopy (std::map<CPos,std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+    /**
+     * @brief Append an instruction pushing the value of a cell.
+     *
+     * @param pos Position of the referenced cell.
+     * @param absoluteColumn True if the column must not move when the formula is copied.
+     * @param absoluteRow True if the row must not move when the formula is copied.
+     */
+    void emitReference(const CPos &pos, bool absoluteColumn, bool absoluteRow);
 
-    void moveRelativelyBy(const std::pair<long long int, long long int> &offset) override;
+    /**
+     * @brief Register a range used as a function argument.
+     *
+     * @param from First corner.
+     * @param to Opposite corner.
+     * @return Index of the range in m_ranges.
+     */
+    int addRange(const CReference &from, const CReference &to);
 
-    void print(std::ostream &os) const override;
+    /**
+     * @brief Append a function call, the code of its value arguments has to be emitted before.
+     *
+     * @param function The function.
+     * @param arguments Index into m_ranges for each range argument, -1 for each value argument.
+     */
+    void emitCall(EFunction function, std::vector<int> arguments);
 
-    bool hasCycle(std::map<CPos, bool, CPosComparator> &visited) const override;
+    /**
+     * @brief Check whether the formula has any code.
+     *
+     * @return True if the formula is empty.
+     */
+    bool empty() const;
 
-private:
-    double m_value;
-};
+    /**
+     * @brief Run the code of the formula.
+     *
+     * @param table Table the referenced cells are read from, their values have to be up to date.
+     * @param anchor Position of the cell the formula is evaluated for.
+     * @return The result of the evaluation.
+     */
+    CCellValue evaluate(const CCells &table, const CPos &anchor) const;
 
+    /**
+     * @brief Convert references not fixed by '$' from absolute positions to offsets from the anchor.
+     *
+     * @param anchor Position of the cell the formula was written into.
+     */
+    void toRelative(const CPos &anchor);
 
+    /**
+     * @brief Get the absolute position of a reference.
+     *
+     * @param ref The reference.
+     * @param anchor Position of the cell holding the formula.
+     * @return Position of the referenced cell.
+     */
+    static CPos resolve(const CReference &ref, const CPos &anchor);
 
+    /**
+     * @brief Compare two formulas, equal formulas have the same contents relative to their cells.
+     *
+     * @param other Formula to compare with.
+     * @return True if the formulas are equal.
+     */
+    bool operator==(const CFormula &other) const;
 
+    /**
+     * @brief Compute a hash consistent with operator==.
+     *
+     * @return The hash.
+     */
+    size_t hash() const;
 
-struct ASTNodeRoot : public  ASTNode
-{
-    ASTNodeRoot(bool isExp = false);
-    CValue evaluate() override;
-    std::shared_ptr<ASTNode> deepCopy(std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
-    void moveRelativelyBy(const std::pair<long long int, long long int> &offset) override;
+    /**
+     * @brief Compute the result of a binary operator.
+     *
+     * @param op The operation.
+     * @param left Left operand.
+     * @param right Right operand.
+     * @return The result, empty if the operator is not defined for the operands.
+     */
+    static CCellValue apply(EOpCode op, const CCellValue &left, const CCellValue &right);
 
-    void print(std::ostream &os) const override;
+    /**
+     * @brief Compute the result of a function call.
+     *
+     * @param call The call.
+     * @param values Values of the arguments that are not ranges, in order.
+     * @param table Table the cells of range arguments are read from.
+     * @param anchor Position of the cell the formula is evaluated for.
+     * @return The result.
+     */
+    CCellValue call(const CCall &call, const CCellValue *values, const CCells &table, const CPos &anchor) const;
 
-    bool hasCycle(std::map<CPos, bool, CPosComparator> &visited) const override;
-};
+    /**
+     * @brief Collect positions of all cells referenced by the formula.
+     *
+     * @param refs Vector the referenced positions are appended to.
+     * @param anchor Position of the cell holding the formula.
+     */
+    void collectReferences(std::vector<CPos> &refs, const CPos &anchor) const;
 
+    /**
+     * @brief Collect all ranges used by the formula.
+     *
+     * @param ranges Vector the ranges are appended to.
+     * @param anchor Position of the cell holding the formula.
+     */
+    void collectRanges(std::vector<CRange> &ranges, const CPos &anchor) const;
 
+    /**
+     * @brief Print the formula in the format understood by parseExpression.
+     *
+     * @param os Output stream to print the formula.
+     * @param anchor Position of the cell holding the formula.
+     */
+    void print(std::ostream &os, const CPos &anchor) const;
 
+    /**
+     * @brief Append the formula in the format understood by parseExpression to a string.
+     *
+     * @param out String to append to.
+     * @param anchor Position of the cell holding the formula.
+     */
+    void print(std::string &out, const CPos &anchor) const;
 
-struct ASTNodeReference: public ASTNode {
-    ASTNodeReference(std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> *table, CPos cell, bool relCol, bool relRow);
+    /**
+     * @brief Check whether print writes a number so that parsing it gives the same number.
+     *
+     * Numbers are printed with %f, which keeps six decimal places and writes infinities and NaN
+     * in a form the parser does not accept.
+     *
+     * @param number The number.
+     * @return True if the number survives printing and parsing.
+     */
+    static bool printsExactly(double number);
 
-    CValue evaluate() override;
-    std::shared_ptr<ASTNode> deepCopy(std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const override;
+    /**
+     * @brief Rewrite the formula for a sheet in which rows or columns were inserted or deleted.
+     *
+     * References follow the cells they point to, including the parts fixed by '$'. A reference to
+     * a deleted cell and a range of deleted cells are replaced by (0/0), which evaluates to an
+     * empty value like any other undefined operation.
+     *
+     * @param shift The change.
+     * @param anchor Position of the cell holding the formula before the change.
+     * @param moved Position of the cell after the change.
+     * @param result Set to the rewritten formula if it differs.
+     * @return False if the formula works unchanged at moved, result is not modified then.
+     */
+    bool shifted(const CShift &shift, const CPos &anchor, const CPos &moved, CFormula &result) const;
 
-    void moveRelativelyBy(const std::pair<long long int, long long int> &offset) override;
+    /**
+     * @brief Check whether the formula reads a cell deleted by a change.
+     *
+     * @param shift The change.
+     * @param anchor Position of the cell holding the formula before the change.
+     * @return True if a referenced cell or a cell of a used range is deleted.
+     */
+    bool readsDeleted(const CShift &shift, const CPos &anchor) const;
 
-    void print(std::ostream &os) const override;
+    /**
+     * @brief Find where the subexpression ending at each instruction starts.
+     *
+     * The operands of an instruction are the subexpressions ending right before it.
+     *
+     * @return Index of the first instruction of each subexpression, by its last instruction.
+     */
+    std::vector<size_t> subexpressionStarts() const;
 
-    bool hasCycle(std::map<CPos, bool, CPosComparator> &visited) const override;
+    /**
+     * @brief Write the code of the formula in postfix order, each instruction followed by its operands.
+     *
+     * @param out Writer to append to.
+     */
+    void write(CBinaryWriter &out) const;
 
-    std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> *m_table;
-    CPos m_pos;
-    bool isColumnRelative, isRowRelative;
+    /**
+     * @brief Read a formula written by write, checking that its code is valid.
+     *
+     * @param in Reader to read from.
+     * @return The formula.
+     * @throw std::invalid_argument If the input is not a valid formula.
+     */
+    static CFormula read(CBinaryReader &in);
+
+    std::vector<CInstruction> m_code;
+    std::vector<CString> m_strings;
+    std::vector<CReference> m_references;
+    std::vector<CRangeReference> m_ranges;
+    std::vector<CCall> m_calls;
+    unsigned m_stackSize = 0; ///< Largest number of values on the stack during evaluation.
+    unsigned m_depth = 0;     ///< Number of values on the stack after the code emitted so far.
+    bool isExpression = false; ///< Flag indicating whether the cell contents start with '='.
+
+    static constexpr size_t SMALL_STACK = 16; ///< Stack size evaluated without a heap allocation.
+    static const char *const FUNCTION_NAMES[FN_COUNT_OF];
 };
 
 
+const char *const CFormula::FUNCTION_NAMES[FN_COUNT_OF] = {"SUM", "AVERAGE", "MIN", "MAX", "COUNT"};
 
-ASTNodeAdd::ASTNodeAdd(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeBinaryOperator("+", l, r){}
-
-CValue ASTNodeAdd::evaluate()
-{
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<std::string>(right))
-        return CValue {std::to_string(std::get<double>(left)) + std::get<std::string>(right)};
-
-    if(std::holds_alternative<std::string>(left) && std::holds_alternative<double>(right))
-        return CValue {std::get<std::string>(left) + std::to_string(std::get<double>(right))};
-
-    if(std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right))
-        return CValue {std::get<std::string>(left) + std::get<std::string>(right)};
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
-        return  CValue{std::get<double>(left) + std::get<double>(right)};
-
-    return CValue {};
-}
-
-std::shared_ptr<ASTNode> ASTNodeAdd::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+CFormula::EFunction CFormula::findFunction(const std::string &name)
 {
-    std::shared_ptr<ASTNodeAdd> copy = std::make_shared<ASTNodeAdd>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    std::string upper;
+    for(const auto &ch : name)
+        upper.push_back(static_cast<char>(std::toupper(static_cast<unsigned char>(ch))));
+    for(int function = 0; function < FN_COUNT_OF; function++)
+    {
+        if(upper == FUNCTION_NAMES[function])
+            return static_cast<EFunction>(function);
+    }
+    throw std::invalid_argument("Unknown function " + name);
 }
 
-ASTNodeSub::ASTNodeSub(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeBinaryOperator("-", l, r){}
-
-CValue ASTNodeSub::evaluate()
-{
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(!std::holds_alternative<double>(left) || !std::holds_alternative<double>(right))
-        return CValue {};
-    return  CValue{std::get<double>(left) - std::get<double>(right)};
-}
 
-std::shared_ptr<ASTNode> ASTNodeSub::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+void CFormula::emit(EOpCode op)
 {
-    std::shared_ptr<ASTNodeSub> copy = std::make_shared<ASTNodeSub>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    m_code.push_back({op});
+    if(op != OP_NEG)
+        m_depth--;
 }
 
-ASTNodeMul::ASTNodeMul(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeBinaryOperator("*", l, r){}
-
-CValue ASTNodeMul::evaluate()
+void CFormula::emitNumber(double value)
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(!std::holds_alternative<double>(left) || !std::holds_alternative<double>(right))
-        return CValue {};
-    return  CValue{std::get<double>(left) * std::get<double>(right)};
+    m_code.push_back({OP_NUMBER, 0, value});
+    m_stackSize = std::max(m_stackSize, ++m_depth);
 }
 
-std::shared_ptr<ASTNode> ASTNodeMul::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+void CFormula::emitString(const std::string &literal)
 {
-    std::shared_ptr<ASTNodeMul> copy = std::make_shared<ASTNodeMul>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    m_code.push_back({OP_STRING, static_cast<unsigned>(m_strings.size())});
+    m_strings.push_back(std::make_shared<const std::string>(literal));
+    m_stackSize = std::max(m_stackSize, ++m_depth);
 }
 
-ASTNodeDiv::ASTNodeDiv(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeBinaryOperator("/", l, r){}
-
-CValue ASTNodeDiv::evaluate()
+void CFormula::emitReference(const CPos &pos, bool absoluteColumn, bool absoluteRow)
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(!std::holds_alternative<double>(left) || !std::holds_alternative<double>(right))
-        return CValue {};
-    if(std::get<double>(right) == 0.0)
-        return CValue {};
-    return  CValue{std::get<double>(left) / std::get<double>(right)};
+    m_code.push_back({OP_REFERENCE, static_cast<unsigned>(m_references.size())});
+    m_references.push_back({pos, absoluteColumn, absoluteRow});
+    m_stackSize = std::max(m_stackSize, ++m_depth);
 }
 
-std::shared_ptr<ASTNode> ASTNodeDiv::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+int CFormula::addRange(const CReference &from, const CReference &to)
 {
-    std::shared_ptr<ASTNodeDiv> copy = std::make_shared<ASTNodeDiv>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    m_ranges.push_back({from, to});
+    return static_cast<int>(m_ranges.size() - 1);
 }
 
-ASTNodePow::ASTNodePow(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeBinaryOperator("^", l, r){}
-
-CValue ASTNodePow::evaluate()
+void CFormula::emitCall(EFunction function, std::vector<int> arguments)
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(!std::holds_alternative<double>(left) || !std::holds_alternative<double>(right))
-        return CValue {};
-    return  CValue{std::pow(std::get<double>(left), std::get<double>(right))};
+    auto values = static_cast<unsigned>(std::count(arguments.begin(), arguments.end(), -1));
+    m_code.push_back({OP_CALL, static_cast<unsigned>(m_calls.size())});
+    m_calls.push_back({function, std::move(arguments)});
+    m_depth = m_depth - values + 1;
+    m_stackSize = std::max(m_stackSize, m_depth);
 }
 
-std::shared_ptr<ASTNode> ASTNodePow::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+bool CFormula::empty() const
 {
-    std::shared_ptr<ASTNodePow> copy = std::make_shared<ASTNodePow>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    return m_code.empty();
 }
 
-ASTNodeEq::ASTNodeEq(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeRelationalOperator("=", l, r){}
-
-CValue ASTNodeEq::evaluate()
+CCellValue CFormula::apply(EOpCode op, const CCellValue &left, const CCellValue &right)
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
-    {
-        return std::get<double>(left) == std::get<double>(right) ? CValue{1.0} : CValue {0.0};
-    }
-    else if(std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right))
+    auto l = std::get_if<double>(&left);
+    auto r = std::get_if<double>(&right);
+    if(l && r)
     {
-        return std::get<std::string>(left) == std::get<std::string>(right) ? CValue{1.0} : CValue {0.0};
+        switch(op)
+        {
+            case OP_ADD: return *l + *r;
+            case OP_SUB: return *l - *r;
+            case OP_MUL: return *l * *r;
+            case OP_DIV: return *r == 0.0 ? CCellValue {} : CCellValue {*l / *r};
+            case OP_POW: return std::pow(*l, *r);
+            case OP_EQ: return *l == *r ? 1.0 : 0.0;
+            case OP_NE: return *l != *r ? 1.0 : 0.0;
+            case OP_LT: return *l < *r ? 1.0 : 0.0;
+            case OP_LE: return *l <= *r ? 1.0 : 0.0;
+            case OP_GT: return *l > *r ? 1.0 : 0.0;
+            case OP_GE: return *l >= *r ? 1.0 : 0.0;
+            default: return CCellValue {};
+        }
     }
-    else
-        return CValue {};
-}
 
-std::shared_ptr<ASTNode> ASTNodeEq::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
-{
-    std::shared_ptr<ASTNodeEq> copy = std::make_shared<ASTNodeEq>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
-}
-
-ASTNodeNe::ASTNodeNe(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeRelationalOperator("<>", l, r){}
-
-CValue ASTNodeNe::evaluate()
-{
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+    auto ls = std::get_if<CString>(&left);
+    auto rs = std::get_if<CString>(&right);
+    if(op == OP_ADD)
     {
-        return std::get<double>(left) != std::get<double>(right) ? CValue{1.0} : CValue {0.0};
+        if(l && rs)
+            return std::make_shared<const std::string>(std::to_string(*l) + **rs);
+        if(ls && r)
+            return std::make_shared<const std::string>(**ls + std::to_string(*r));
+        if(ls && rs)
+            return std::make_shared<const std::string>(**ls + **rs);
+        return CCellValue {};
     }
-    else if(std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right))
+    if(!ls || !rs)
+        return CCellValue {};
+    // Values copied from the same cell or literal share the string, so comparing them needs no scan.
+    int order = *ls == *rs ? 0 : (*ls)->compare(**rs);
+    switch(op)
     {
-        return std::get<std::string>(left) != std::get<std::string>(right) ? CValue{1.0} : CValue {0.0};
+        case OP_EQ: return order == 0 ? 1.0 : 0.0;
+        case OP_NE: return order != 0 ? 1.0 : 0.0;
+        case OP_LT: return order < 0 ? 1.0 : 0.0;
+        case OP_LE: return order <= 0 ? 1.0 : 0.0;
+        case OP_GT: return order > 0 ? 1.0 : 0.0;
+        case OP_GE: return order >= 0 ? 1.0 : 0.0;
+        default: return CCellValue {};
     }
-    else
-        return CValue {};
-}
-
-std::shared_ptr<ASTNode> ASTNodeNe::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
-{
-    std::shared_ptr<ASTNodeNe> copy = std::make_shared<ASTNodeNe>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
 }
 
-ASTNodeLt::ASTNodeLt(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeRelationalOperator("<", l, r){}
-
-CValue ASTNodeLt::evaluate()
+void CFormula::toRelative(const CPos &anchor)
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+    // Offsets are kept modulo 2^32, resolve adds the anchor back the same way.
+    auto relative = [&anchor](CReference &ref)
     {
-        return std::get<double>(left) < std::get<double>(right) ? CValue{1.0} : CValue {0.0};
-    }
-    else if(std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right))
+        ref.m_pos = CPos(ref.m_absoluteColumn ? ref.m_pos.getColumn() : static_cast<int32_t>(ref.m_pos.getColumn() - anchor.getColumn()),
+                         ref.m_absoluteRow ? ref.m_pos.getRow() : static_cast<int32_t>(ref.m_pos.getRow() - anchor.getRow()));
+    };
+    for(auto &ref : m_references)
+        relative(ref);
+    for(auto &range : m_ranges)
     {
-        return std::get<std::string>(left) < std::get<std::string>(right) ? CValue{1.0} : CValue {0.0};
+        relative(range.m_from);
+        relative(range.m_to);
     }
-    else
-        return CValue {};
 }
 
-std::shared_ptr<ASTNode> ASTNodeLt::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+CPos CFormula::resolve(const CReference &ref, const CPos &anchor)
 {
-    std::shared_ptr<ASTNodeLt> copy = std::make_shared<ASTNodeLt>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    return CPos(ref.m_absoluteColumn ? ref.m_pos.getColumn() : static_cast<int32_t>(anchor.getColumn() + ref.m_pos.getColumn()),
+                ref.m_absoluteRow ? ref.m_pos.getRow() : static_cast<int32_t>(anchor.getRow() + ref.m_pos.getRow()));
 }
 
-ASTNodeLe::ASTNodeLe(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeRelationalOperator("<=", l, r){}
-
-CValue ASTNodeLe::evaluate()
+bool CFormula::CReference::operator==(const CReference &other) const
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
-    {
-        return std::get<double>(left) <= std::get<double>(right) ? CValue{1.0} : CValue {0.0};
-    }
-    else if(std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right))
-    {
-        return std::get<std::string>(left) <= std::get<std::string>(right) ? CValue{1.0} : CValue {0.0};
-    }
-    else
-        return CValue {};
+    return m_pos == other.m_pos && m_absoluteColumn == other.m_absoluteColumn && m_absoluteRow == other.m_absoluteRow;
 }
 
-std::shared_ptr<ASTNode> ASTNodeLe::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+bool CFormula::CRangeReference::operator==(const CRangeReference &other) const
 {
-    std::shared_ptr<ASTNodeLe> copy = std::make_shared<ASTNodeLe>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    return m_from == other.m_from && m_to == other.m_to;
 }
 
-ASTNodeGt::ASTNodeGt(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeRelationalOperator(">", l, r){}
-
-CValue ASTNodeGt::evaluate()
+bool CFormula::CCall::operator==(const CCall &other) const
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
-    {
-        return std::get<double>(left) > std::get<double>(right) ? CValue{1.0} : CValue {0.0};
-    }
-    else if(std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right))
-    {
-        return std::get<std::string>(left) > std::get<std::string>(right) ? CValue{1.0} : CValue {0.0};
-    }
-    else
-        return CValue {};
+    return m_function == other.m_function && m_arguments == other.m_arguments;
 }
 
-std::shared_ptr<ASTNode> ASTNodeGt::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+bool CFormula::operator==(const CFormula &other) const
 {
-    std::shared_ptr<ASTNodeGt> copy = std::make_shared<ASTNodeGt>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
+    if(isExpression != other.isExpression || m_code.size() != other.m_code.size())
+        return false;
+    for(size_t i = 0; i < m_code.size(); i++)
+    {
+        // Numbers are compared bitwise, 0 and -0 print differently.
+        const auto &a = m_code[i], &b = other.m_code[i];
+        if(a.m_op != b.m_op || a.m_arg != b.m_arg || std::memcmp(&a.m_number, &b.m_number, sizeof(double)) != 0)
+            return false;
+    }
+    auto sameText = [](const CString &a, const CString &b) { return *a == *b; };
+    return std::equal(m_strings.begin(), m_strings.end(), other.m_strings.begin(), other.m_strings.end(), sameText)
+           && m_references == other.m_references && m_ranges == other.m_ranges && m_calls == other.m_calls;
 }
 
-ASTNodeGe::ASTNodeGe(std::shared_ptr<ASTNode> l, std::shared_ptr<ASTNode> r) : ASTNodeRelationalOperator(">=", l, r){}
-
-CValue ASTNodeGe::evaluate()
+size_t CFormula::hash() const
 {
-    auto left = m_left->evaluate();
-    auto right = m_right->evaluate();
-
-    if(std::holds_alternative<double>(left) && std::holds_alternative<double>(right))
+    size_t result = isExpression;
+    auto combine = [&result](size_t value)
     {
-        return std::get<double>(left) >= std::get<double>(right) ? CValue{1.0} : CValue {0.0};
-    }
-    else if(std::holds_alternative<std::string>(left) && std::holds_alternative<std::string>(right))
+        result ^= value + 0x9e3779b97f4a7c15ULL + (result << 6) + (result >> 2);
+    };
+    for(const auto &instr : m_code)
     {
-        return std::get<std::string>(left) >= std::get<std::string>(right) ? CValue{1.0} : CValue {0.0};
+        uint64_t bits;
+        std::memcpy(&bits, &instr.m_number, sizeof(bits));
+        combine(instr.m_op);
+        combine(instr.m_arg);
+        combine(std::hash<uint64_t>()(bits));
     }
-    else
-        return CValue {};
+    for(const auto &literal : m_strings)
+        combine(std::hash<std::string>()(*literal));
+    for(const auto &ref : m_references)
+        combine(ref.m_pos.getKey() ^ (ref.m_absoluteColumn ? 1 : 0) ^ (ref.m_absoluteRow ? 2 : 0));
+    for(const auto &range : m_ranges)
+        combine(range.m_from.m_pos.getKey() ^ range.m_to.m_pos.getKey());
+    return result;
 }
 
-std::shared_ptr<ASTNode> ASTNodeGe::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+void CFormula::collectReferences(std::vector<CPos> &refs, const CPos &anchor) const
 {
-    std::shared_ptr<ASTNodeGe> copy = std::make_shared<ASTNodeGe>(nullptr, nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    copy->m_right = m_right->deepCopy(map);
-    return copy;
-}
-
-ASTNodeNeg::ASTNodeNeg(std::shared_ptr<ASTNode> l) : ASTNodeUnaryOperator("-", l) {}
-
-CValue ASTNodeNeg::evaluate() {
-    auto left = m_left->evaluate();
-    if(!std::holds_alternative<double>(left))
-        return CValue{};
-    return  CValue{ -1 * std::get<double>(left)};
+    for(const auto &ref : m_references)
+        refs.push_back(resolve(ref, anchor));
 }
 
-std::shared_ptr<ASTNode> ASTNodeNeg::deepCopy (std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+void CFormula::collectRanges(std::vector<CRange> &ranges, const CPos &anchor) const
 {
-    std::shared_ptr<ASTNodeNeg> copy = std::make_shared<ASTNodeNeg>(nullptr);
-    copy->m_left = m_left->deepCopy(map);
-    return copy;
+    for(const auto &range : m_ranges)
+        ranges.emplace_back(resolve(range.m_from, anchor), resolve(range.m_to, anchor));
 }
 
-ASTStringLiteral::ASTStringLiteral(const std::string &literal, bool isExp) : ASTNode(nullptr, nullptr, isExp), m_literal(literal){}
-
-    CValue ASTStringLiteral::evaluate ()
-    {
-        return CValue(m_literal);
-    }
-
-    std::shared_ptr<ASTNode> ASTStringLiteral::deepCopy (std::map<CPos,std::shared_ptr<ASTNode>, CPosComparator> &map) const
+void CFormula::write(CBinaryWriter &out) const
+{
+    auto writeReference = [&out](const CReference &ref)
     {
-        auto copy = std::make_shared<ASTStringLiteral>(m_literal, isExpression);
-        return copy;
-    }
-
-    void ASTStringLiteral::moveRelativelyBy(const std::pair<long long int, long long int> &offset) {}
-
-    void ASTStringLiteral::print(std::ostream &os) const
+        out.writeI32(static_cast<int32_t>(ref.m_pos.getColumn()));
+        out.writeI32(static_cast<int32_t>(ref.m_pos.getRow()));
+        out.writeByte(static_cast<uint8_t>((ref.m_absoluteColumn ? 1 : 0) | (ref.m_absoluteRow ? 2 : 0)));
+    };
+
+    out.writeByte(isExpression ? 1 : 0);
+    out.writeU32(static_cast<uint32_t>(m_code.size()));
+    for(const auto &instr : m_code)
     {
-        if(isExpression)
+        out.writeByte(instr.m_op);
+        switch(instr.m_op)
         {
-            std::string result;
-            result.push_back('\"');
-            for(const auto &ch : m_literal)
+            case OP_NUMBER:
+                out.writeDouble(instr.m_number);
+                break;
+            case OP_STRING:
+                out.writeString(*m_strings[instr.m_arg]);
+                break;
+            case OP_REFERENCE:
+                writeReference(m_references[instr.m_arg]);
+                break;
+            case OP_CALL:
             {
-                if(ch == '\"')
-                    result.push_back(ch);
-                result.push_back(ch);
+                const auto &called = m_calls[instr.m_arg];
+                out.writeByte(called.m_function);
+                out.writeU32(static_cast<uint32_t>(called.m_arguments.size()));
+                for(auto argument : called.m_arguments)
+                {
+                    out.writeByte(argument < 0 ? 0 : 1);
+                    if(argument >= 0)
+                    {
+                        writeReference(m_ranges[argument].m_from);
+                        writeReference(m_ranges[argument].m_to);
+                    }
+                }
+                break;
             }
-            result.push_back('\"');
-            os << result;
+            default:
+                break;
         }
+    }
+}
+
+CFormula CFormula::read(CBinaryReader &in)
+{
+    auto readReference = [&in]()
+    {
+        auto column = in.readI32();
+        auto row = in.readI32();
+        auto flags = in.readByte();
+        return CReference {CPos(column, row), (flags & 1) != 0, (flags & 2) != 0};
+    };
+
+    // The code is rebuilt through the emit functions, so the bookkeeping matches a parsed formula,
+    // and every instruction is checked to find enough values on the stack.
+    CFormula formula;
+    formula.isExpression = in.readByte() != 0;
+    auto size = in.readU32();
+    for(uint32_t i = 0; i < size; i++)
+    {
+        auto op = static_cast<EOpCode>(in.readByte());
+        switch(op)
+        {
+            case OP_NUMBER:
+                formula.emitNumber(in.readDouble());
+                break;
+            case OP_STRING:
+                formula.emitString(in.readString());
+                break;
+            case OP_REFERENCE:
+            {
+                auto ref = readReference();
+                formula.emitReference(ref.m_pos, ref.m_absoluteColumn, ref.m_absoluteRow);
+                break;
+            }
+            case OP_CALL:
+            {
+                auto function = in.readByte();
+                auto count = in.readU32();
+                if(function >= FN_COUNT_OF || count == 0)
+                    throw std::invalid_argument("Invalid function call in binary sheet");
+                std::vector<int> arguments;
+                unsigned values = 0;
+                for(uint32_t argument = 0; argument < count; argument++)
+                {
+                    if(in.readByte() == 0)
+                    {
+                        arguments.push_back(-1);
+                        values++;
+                        continue;
+                    }
+                    auto from = readReference();
+                    auto to = readReference();
+                    arguments.push_back(formula.addRange(from, to));
+                }
+                if(formula.m_depth < values)
+                    throw std::invalid_argument("Invalid function call in binary sheet");
+                formula.emitCall(static_cast<EFunction>(function), std::move(arguments));
+                break;
+            }
+            case OP_NEG:
+                if(formula.m_depth < 1)
+                    throw std::invalid_argument("Invalid code in binary sheet");
+                formula.emit(op);
+                break;
+            default:
+                if(op > OP_CALL || formula.m_depth < 2)
+                    throw std::invalid_argument("Invalid code in binary sheet");
+                formula.emit(op);
+                break;
+        }
+    }
+    if(formula.m_depth != 1)
+        throw std::invalid_argument("Invalid code in binary sheet");
+    return formula;
+}
+
+bool CFormula::printsExactly(double number)
+{
+    if(!std::isfinite(number))
+        return false;
+    char text[512];
+    std::snprintf(text, sizeof(text), "%f", number);
+    return std::strtod(text, nullptr) == number;
+}
+
+std::vector<size_t> CFormula::subexpressionStarts() const
+{
+    std::vector<size_t> starts(m_code.size());
+    std::vector<size_t> open;
+    for(size_t i = 0; i < m_code.size(); i++)
+    {
+        size_t operands = 0;
+        switch(m_code[i].m_op)
+        {
+            case OP_NUMBER:
+            case OP_STRING:
+            case OP_REFERENCE:
+                break;
+            case OP_NEG:
+                operands = 1;
+                break;
+            case OP_CALL:
+            {
+                const auto &arguments = m_calls[m_code[i].m_arg].m_arguments;
+                operands = static_cast<size_t>(std::count(arguments.begin(), arguments.end(), -1));
+                break;
+            }
+            default:
+                operands = 2;
+                break;
+        }
+        starts[i] = operands > 0 ? open[open.size() - operands] : i;
+        open.resize(open.size() - operands);
+        open.push_back(starts[i]);
+    }
+    return starts;
+}
+
+bool CFormula::readsDeleted(const CShift &shift, const CPos &anchor) const
+{
+    if(shift.m_count > 0)
+        return false;
+    for(const auto &ref : m_references)
+    {
+        auto pos = resolve(ref, anchor);
+        if(shift.deletes(CRange(pos, pos)))
+            return true;
+    }
+    for(const auto &range : m_ranges)
+    {
+        if(shift.deletes(CRange(resolve(range.m_from, anchor), resolve(range.m_to, anchor))))
+            return true;
+    }
+    return false;
+}
+
+bool CFormula::shifted(const CShift &shift, const CPos &anchor, const CPos &moved, CFormula &result) const
+{
+    // Where a reference points to after the change, in the form toRelative gives it for moved.
+    auto encode = [&moved](const CPos &target, const CReference &ref)
+    {
+        return CReference {CPos(ref.m_absoluteColumn ? target.getColumn() : static_cast<int32_t>(target.getColumn() - moved.getColumn()),
+                                ref.m_absoluteRow ? target.getRow() : static_cast<int32_t>(target.getRow() - moved.getRow())),
+                           ref.m_absoluteColumn, ref.m_absoluteRow};
+    };
+    auto reference = [&shift, &anchor](const CReference &ref)
+    {
+        return shift.map(resolve(ref, anchor));
+    };
+    // The corners are kept as written, each one takes the side of the new range it was on.
+    auto range = [&shift, &anchor](const CRangeReference &ref) -> std::optional<std::pair<CPos, CPos>>
+    {
+        auto from = resolve(ref.m_from, anchor), to = resolve(ref.m_to, anchor);
+        auto mapped = shift.map(CRange(from, to));
+        if(!mapped)
+            return std::nullopt;
+        auto corner = [&shift, &mapped](const CPos &pos, const CPos &other)
+        {
+            bool low = shift.coordinate(pos) <= shift.coordinate(other);
+            return shift.withCoordinate(pos, shift.coordinate(low ? mapped->m_from : mapped->m_to));
+        };
+        return std::make_pair(corner(from, to), corner(to, from));
+    };
+
+    bool changed = false;
+    for(const auto &ref : m_references)
+    {
+        auto target = reference(ref);
+        changed = changed || !target || !(encode(*target, ref) == ref);
+    }
+    for(const auto &ref : m_ranges)
+    {
+        auto corners = range(ref);
+        changed = changed || !corners || !(encode(corners->first, ref.m_from) == ref.m_from) || !(encode(corners->second, ref.m_to) == ref.m_to);
+    }
+    if(!changed)
+        return false;
+
+    // A deleted range argument becomes a value argument, its (0/0) goes where the code of the
+    // next value argument starts, or right before the call if no value argument follows.
+    auto starts = subexpressionStarts();
+    std::vector<unsigned> undefinedBefore(m_code.size(), 0);
+    for(size_t i = 0; i < m_code.size(); i++)
+    {
+        if(m_code[i].m_op != OP_CALL)
+            continue;
+        const auto &arguments = m_calls[m_code[i].m_arg].m_arguments;
+        size_t next = i;
+        for(size_t argument = arguments.size(); argument > 0; argument--)
+        {
+            if(arguments[argument - 1] < 0)
+                next = starts[next - 1];
+            else if(!range(m_ranges[arguments[argument - 1]]))
+                undefinedBefore[next]++;
+        }
+    }
+
+    CFormula formula;
+    formula.isExpression = isExpression;
+    auto emitUndefined = [&formula]()
+    {
+        formula.emitNumber(0);
+        formula.emitNumber(0);
+        formula.emit(OP_DIV);
+    };
+    for(size_t i = 0; i < m_code.size(); i++)
+    {
+        for(unsigned undefined = 0; undefined < undefinedBefore[i]; undefined++)
+            emitUndefined();
+        const auto &instr = m_code[i];
+        switch(instr.m_op)
+        {
+            case OP_NUMBER:
+                formula.emitNumber(instr.m_number);
+                break;
+            case OP_STRING:
+                formula.m_code.push_back({OP_STRING, static_cast<unsigned>(formula.m_strings.size())});
+                formula.m_strings.push_back(m_strings[instr.m_arg]);
+                formula.m_stackSize = std::max(formula.m_stackSize, ++formula.m_depth);
+                break;
+            case OP_REFERENCE:
+            {
+                const auto &ref = m_references[instr.m_arg];
+                if(auto target = reference(ref))
+                    formula.emitReference(*target, ref.m_absoluteColumn, ref.m_absoluteRow);
+                else
+                    emitUndefined();
+                break;
+            }
+            case OP_CALL:
+            {
+                const auto &call = m_calls[instr.m_arg];
+                std::vector<int> arguments;
+                for(const auto &argument : call.m_arguments)
+                {
+                    auto corners = argument < 0 ? std::nullopt : range(m_ranges[argument]);
+                    if(!corners)
+                    {
+                        arguments.push_back(-1);
+                        continue;
+                    }
+                    const auto &ref = m_ranges[argument];
+                    arguments.push_back(formula.addRange({corners->first, ref.m_from.m_absoluteColumn, ref.m_from.m_absoluteRow},
+                                                         {corners->second, ref.m_to.m_absoluteColumn, ref.m_to.m_absoluteRow}));
+                }
+                formula.emitCall(call.m_function, std::move(arguments));
+                break;
+            }
+            default:
+                formula.emit(instr.m_op);
+                break;
+        }
+    }
+    formula.toRelative(moved);
+    result = std::move(formula);
+    return true;
+}
+
+void CFormula::print(std::ostream &os, const CPos &anchor) const
+{
+    std::string out;
+    print(out, anchor);
+    os << out;
+}
+
+void CFormula::print(std::string &out, const CPos &anchor) const
+{
+    auto printReference = [&out, &anchor](const CReference &ref)
+    {
+        auto pos = resolve(ref, anchor);
+        if(ref.m_absoluteColumn)
+            out += '$';
+        pos.appendColumnTo(out);
+        if(ref.m_absoluteRow)
+            out += '$';
+        char row[16];
+        out.append(row, std::to_chars(row, row + sizeof(row), pos.getRow()).ptr);
+    };
+
+    if(isExpression)
+        out += '=';
+    if(m_code.empty())
+        return;
+
+    // Knowing where each subexpression starts, the formula can be printed in infix order in a single pass.
+    auto starts = subexpressionStarts();
+
+    // Print from an explicit stack of pending pieces instead of recursing, so the depth of the
+    // formula is only limited by memory. A piece is a subexpression, a range or a piece of text.
+    enum EPiece { PIECE_EXPRESSION, PIECE_RANGE, PIECE_TEXT };
+    struct CPiece
+    {
+        EPiece m_kind;
+        size_t m_index;     ///< Last instruction of a subexpression or index of a range.
+        const char *m_text; ///< Text to append for PIECE_TEXT.
+    };
+    static const char *const symbols[] = {"", "", "", "+", "-", "*", "/", "^", "-", "=", "<>", "<", "<=", ">", ">=", ""};
+    std::vector<CPiece> pending { {PIECE_EXPRESSION, m_code.size() - 1, nullptr} };
+    while(!pending.empty())
+    {
+        auto piece = pending.back();
+        pending.pop_back();
+        if(piece.m_kind == PIECE_TEXT)
+        {
+            out += piece.m_text;
+            continue;
+        }
+        if(piece.m_kind == PIECE_RANGE)
+        {
+            const auto &range = m_ranges[piece.m_index];
+            printReference(range.m_from);
+            out += ':';
+            printReference(range.m_to);
+            continue;
+        }
+
+        size_t end = piece.m_index;
+        const auto &instr = m_code[end];
+        switch(instr.m_op)
+        {
+            case OP_NUMBER:
+            {
+                // A negative number in a formula, folded from a negated literal, needs parentheses
+                // because -8^0.5 reads as -(8^0.5).
+                char number[512];
+                auto negative = isExpression && std::signbit(instr.m_number);
+                if(negative)
+                    out += '(';
+                auto length = std::snprintf(number, sizeof(number), "%f", instr.m_number);
+                out.append(number, static_cast<size_t>(length));
+                if(negative)
+                    out += ')';
+                break;
+            }
+            case OP_STRING:
+            {
+                const auto &literal = *m_strings[instr.m_arg];
+                if(!isExpression)
+                {
+                    out += literal;
+                    break;
+                }
+                out.push_back('\"');
+                for(const auto &ch : literal)
+                {
+                    if(ch == '\"')
+                        out.push_back(ch);
+                    out.push_back(ch);
+                }
+                out.push_back('\"');
+                break;
+            }
+            case OP_REFERENCE:
+                printReference(m_references[instr.m_arg]);
+                break;
+            case OP_CALL:
+            {
+                // Value arguments end right before the call and right before the start of the
+                // next one, so they are found from the last argument backwards.
+                const auto &call = m_calls[instr.m_arg];
+                out += FUNCTION_NAMES[call.m_function];
+                out += '(';
+                pending.push_back({PIECE_TEXT, 0, ")"});
+                size_t last = end - 1;
+                for(size_t i = call.m_arguments.size(); i > 0; i--)
+                {
+                    if(call.m_arguments[i - 1] < 0)
+                    {
+                        pending.push_back({PIECE_EXPRESSION, last, nullptr});
+                        last = starts[last] - 1;
+                    }
+                    else
+                        pending.push_back({PIECE_RANGE, static_cast<size_t>(call.m_arguments[i - 1]), nullptr});
+                    if(i > 1)
+                        pending.push_back({PIECE_TEXT, 0, ","});
+                }
+                break;
+            }
+            case OP_NEG:
+                out += "(-";
+                pending.push_back({PIECE_TEXT, 0, ")"});
+                pending.push_back({PIECE_EXPRESSION, end - 1, nullptr});
+                break;
+            default:
+                out += '(';
+                pending.push_back({PIECE_TEXT, 0, ")"});
+                pending.push_back({PIECE_EXPRESSION, end - 1, nullptr});
+                pending.push_back({PIECE_TEXT, 0, symbols[instr.m_op]});
+                pending.push_back({PIECE_EXPRESSION, starts[end - 1] - 1, nullptr});
+                break;
+        }
+    }
+}
+
+
+/**
+ * @brief Base class representing a node in the abstract syntax tree (AST).
+ *
+ * The tree only exists while CBuilder assembles a formula, which is then compiled into a CFormula.
+ * Nodes live in the arena of the table and are released all at once after compilation.
+ */
+struct ASTNode {
+    /**
+     * @brief Constructor for ASTNode.
+     *
+     * @param l Pointer to the left child node.
+     * @param r Pointer to the right child node.
+     * @param isExp Flag indicating whether the node represents an expression.
+     */
+    ASTNode(ASTNode *l, ASTNode *r, bool isExp = false) : m_left(l), m_right(r), isExpression(isExp){}
+
+    /**
+     * @brief Virtual destructor for ASTNode.
+     */
+    virtual ~ASTNode() = default;
+
+    /**
+     * @brief Append the code of the node itself, which follows the code of its operands.
+     *
+     * @param formula Formula the code is appended to.
+     */
+    virtual void compile(CFormula &formula) const = 0;
+
+    /**
+     * @brief List the children whose code precedes the code of the node, in order.
+     *
+     * @param operands Vector the children are appended to.
+     */
+    virtual void operands(std::vector<const ASTNode *> &operands) const
+    {
+        if(m_left != nullptr)
+            operands.push_back(m_left);
+        if(m_right != nullptr)
+            operands.push_back(m_right);
+    }
+
+    /**
+     * @brief Append the postfix code of a tree to a formula.
+     *
+     * Walks the tree with an explicit stack, so the depth of the tree is only limited by memory.
+     *
+     * @param root Root of the tree.
+     * @param formula Formula the code is appended to.
+     */
+    static void compileTree(const ASTNode *root, CFormula &formula);
+
+    ASTNode *m_left; ///< Pointer to the left child node.
+    ASTNode *m_right; ///< Pointer to the right child node.
+    bool isExpression; ///< Flag indicating whether the node represents an expression.
+};
+
+
+
+/**
+ * @brief Class representing a binary arithmetic operator node in the abstract syntax tree (AST).
+ *
+ * This class represents a binary arithmetic operator node in the AST.
+ * It inherits from the ASTNode class and provides common functionalities for binary arithmetic operators.
+ */
+struct ASTNodeBinaryOperator : public ASTNode {
+    /**
+     * @brief Constructor for ASTNodeBinaryOperator.
+     *
+     * @param op The operation.
+     * @param l Pointer to the left child node.
+     * @param r Pointer to the right child node.
+     */
+    ASTNodeBinaryOperator(CFormula::EOpCode op, ASTNode *l, ASTNode *r);
+
+    /**
+     * @brief Compile the operator, after both children.
+     *
+     * @param formula Formula the code is appended to.
+     */
+    void compile(CFormula &formula) const override;
+
+    CFormula::EOpCode m_op; /**< The operation. */
+};
+
+
+ASTNodeBinaryOperator::ASTNodeBinaryOperator(CFormula::EOpCode op, ASTNode *l, ASTNode *r) : ASTNode(l, r), m_op(op){}
+
+
+void ASTNode::compileTree(const ASTNode *root, CFormula &formula)
+{
+    // A node is compiled when it is popped the second time, after everything pushed above it.
+    std::vector<std::pair<const ASTNode *, bool>> pending { {root, false} };
+    std::vector<const ASTNode *> children;
+    while(!pending.empty())
+    {
+        auto [node, expanded] = pending.back();
+        if(expanded)
+        {
+            pending.pop_back();
+            node->compile(formula);
+            continue;
+        }
+        pending.back().second = true;
+        children.clear();
+        node->operands(children);
+        for(auto child = children.rbegin(); child != children.rend(); ++child)
+            pending.emplace_back(*child, false);
+    }
+}
+
+    void ASTNodeBinaryOperator::compile(CFormula &formula) const
+    {
+        formula.emit(m_op);
+    }
+
+
+
+struct ASTNodeRelationalOperator : public ASTNode {
+
+    ASTNodeRelationalOperator(CFormula::EOpCode op, ASTNode *l, ASTNode *r);
+
+    void compile(CFormula &formula) const override;
+
+    CFormula::EOpCode m_op;
+};
+
+
+ASTNodeRelationalOperator::ASTNodeRelationalOperator(CFormula::EOpCode op, ASTNode *l, ASTNode *r) : ASTNode(l, r), m_op(op){}
+
+
+void ASTNodeRelationalOperator::compile(CFormula &formula) const
+{
+    formula.emit(m_op);
+}
+
+
+struct ASTNodeUnaryOperator : public ASTNode
+{
+    ASTNodeUnaryOperator(CFormula::EOpCode op, ASTNode *l);
+
+    void compile(CFormula &formula) const override;
+
+    CFormula::EOpCode m_op;
+};
+
+
+ASTNodeUnaryOperator::ASTNodeUnaryOperator(CFormula::EOpCode op, ASTNode *l) : ASTNode(l, nullptr), m_op(op){}
+
+    void ASTNodeUnaryOperator::compile(CFormula &formula) const
+    {
+        formula.emit(m_op);
+    }
+
+struct ASTNodeAdd : public ASTNodeBinaryOperator
+{
+    ASTNodeAdd(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeSub : public ASTNodeBinaryOperator
+{
+    ASTNodeSub(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeMul : public ASTNodeBinaryOperator
+{
+    ASTNodeMul(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeDiv : public ASTNodeBinaryOperator
+{
+    ASTNodeDiv(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodePow : public ASTNodeBinaryOperator
+{
+    ASTNodePow(ASTNode *l, ASTNode *r);
+};
+
+
+
+struct ASTNodeEq : public ASTNodeRelationalOperator
+{
+    ASTNodeEq(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeNe : public ASTNodeRelationalOperator
+{
+    ASTNodeNe(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeLt : public ASTNodeRelationalOperator
+{
+    ASTNodeLt(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeLe : public ASTNodeRelationalOperator
+{
+    ASTNodeLe(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeGt : public ASTNodeRelationalOperator
+{
+    ASTNodeGt(ASTNode *l, ASTNode *r);
+};
+
+struct ASTNodeGe : public ASTNodeRelationalOperator
+{
+    ASTNodeGe(ASTNode *l, ASTNode *r);
+};
+
+
+
+struct ASTNodeNeg : public ASTNodeUnaryOperator
+{
+    ASTNodeNeg(ASTNode *l);
+};
+
+
+
+struct ASTStringLiteral: public ASTNode
+{
+    ASTStringLiteral(const std::string &literal, bool isExp);
+
+    void compile(CFormula &formula) const override;
+
+    /**
+     * @brief Get the string.
+     *
+     * @return The string.
+     */
+    const std::string &literal() const;
+private:
+    std::string m_literal;
+};
+
+
+
+
+struct ASTNodeDouble: public ASTNode
+{
+
+    ASTNodeDouble(double value);
+
+    void compile(CFormula &formula) const override;
+
+    /**
+     * @brief Get the number.
+     *
+     * @return The number.
+     */
+    double value() const;
+
+private:
+    double m_value;
+};
+
+
+
+
+struct ASTNodeReference: public ASTNode {
+    ASTNodeReference(CPos cell, bool relCol, bool relRow);
+
+    void compile(CFormula &formula) const override;
+
+    CPos m_pos;
+    bool isColumnRelative, isRowRelative;
+};
+
+
+
+/**
+ * @brief Range of cells, only valid as an argument of a function.
+ */
+struct ASTNodeRange: public ASTNode {
+    ASTNodeRange(const CFormula::CReference &from, const CFormula::CReference &to);
+
+    /**
+     * @brief Reject the range, it is compiled by the enclosing ASTNodeFunction instead.
+     *
+     * @param formula Formula the code would be appended to.
+     * @throw std::invalid_argument Always.
+     */
+    void compile(CFormula &formula) const override;
+
+    CFormula::CReference m_from, m_to;
+};
+
+
+
+/**
+ * @brief Call of a built-in function.
+ */
+struct ASTNodeFunction: public ASTNode {
+    ASTNodeFunction(CFormula::EFunction function, std::vector<ASTNode *> arguments);
+
+    /**
+     * @brief Compile the call, after the value arguments. Range arguments are attached to the call.
+     *
+     * @param formula Formula the code is appended to.
+     */
+    void compile(CFormula &formula) const override;
+
+    /**
+     * @brief List the value arguments, range arguments have no code of their own.
+     *
+     * @param operands Vector the arguments are appended to.
+     */
+    void operands(std::vector<const ASTNode *> &operands) const override;
+
+    CFormula::EFunction m_function;
+    std::vector<ASTNode *> m_arguments;
+};
+
+
+
+ASTNodeAdd::ASTNodeAdd(ASTNode *l, ASTNode *r) : ASTNodeBinaryOperator(CFormula::OP_ADD, l, r){}
+
+ASTNodeSub::ASTNodeSub(ASTNode *l, ASTNode *r) : ASTNodeBinaryOperator(CFormula::OP_SUB, l, r){}
+
+ASTNodeMul::ASTNodeMul(ASTNode *l, ASTNode *r) : ASTNodeBinaryOperator(CFormula::OP_MUL, l, r){}
+
+ASTNodeDiv::ASTNodeDiv(ASTNode *l, ASTNode *r) : ASTNodeBinaryOperator(CFormula::OP_DIV, l, r){}
+
+ASTNodePow::ASTNodePow(ASTNode *l, ASTNode *r) : ASTNodeBinaryOperator(CFormula::OP_POW, l, r){}
+
+ASTNodeEq::ASTNodeEq(ASTNode *l, ASTNode *r) : ASTNodeRelationalOperator(CFormula::OP_EQ, l, r){}
+
+ASTNodeNe::ASTNodeNe(ASTNode *l, ASTNode *r) : ASTNodeRelationalOperator(CFormula::OP_NE, l, r){}
+
+ASTNodeLt::ASTNodeLt(ASTNode *l, ASTNode *r) : ASTNodeRelationalOperator(CFormula::OP_LT, l, r){}
+
+ASTNodeLe::ASTNodeLe(ASTNode *l, ASTNode *r) : ASTNodeRelationalOperator(CFormula::OP_LE, l, r){}
+
+ASTNodeGt::ASTNodeGt(ASTNode *l, ASTNode *r) : ASTNodeRelationalOperator(CFormula::OP_GT, l, r){}
+
+ASTNodeGe::ASTNodeGe(ASTNode *l, ASTNode *r) : ASTNodeRelationalOperator(CFormula::OP_GE, l, r){}
+
+ASTNodeNeg::ASTNodeNeg(ASTNode *l) : ASTNodeUnaryOperator(CFormula::OP_NEG, l) {}
+
+ASTStringLiteral::ASTStringLiteral(const std::string &literal, bool isExp) : ASTNode(nullptr, nullptr, isExp), m_literal(literal){}
+
+    void ASTStringLiteral::compile(CFormula &formula) const
+    {
+        formula.emitString(m_literal);
+    }
+
+    const std::string &ASTStringLiteral::literal() const
+    {
+        return m_literal;
+    }
+
+ASTNodeDouble::ASTNodeDouble(double value) : ASTNode(nullptr, nullptr), m_value(value){}
+
+void ASTNodeDouble::compile(CFormula &formula) const
+{
+    formula.emitNumber(m_value);
+}
+
+double ASTNodeDouble::value() const
+{
+    return m_value;
+}
+
+ASTNodeReference::ASTNodeReference(CPos cell, bool relCol, bool relRow) :
+            ASTNode(nullptr, nullptr),
+            m_pos(cell),
+            isColumnRelative(relCol),
+            isRowRelative(relRow) {}
+
+    void ASTNodeReference::compile(CFormula &formula) const
+    {
+        formula.emitReference(m_pos, isColumnRelative, isRowRelative);
+    }
+
+ASTNodeRange::ASTNodeRange(const CFormula::CReference &from, const CFormula::CReference &to) : ASTNode(nullptr, nullptr), m_from(from), m_to(to) {}
+
+    void ASTNodeRange::compile(CFormula &) const
+    {
+        throw std::invalid_argument("Range outside of a function call");
+    }
+
+ASTNodeFunction::ASTNodeFunction(CFormula::EFunction function, std::vector<ASTNode *> arguments) :
+            ASTNode(nullptr, nullptr),
+            m_function(function),
+            m_arguments(std::move(arguments)) {}
+
+    void ASTNodeFunction::operands(std::vector<const ASTNode *> &operands) const
+    {
+        for(const auto &argument : m_arguments)
+        {
+            if(dynamic_cast<const ASTNodeRange *>(argument) == nullptr)
+                operands.push_back(argument);
+        }
+    }
+
+    void ASTNodeFunction::compile(CFormula &formula) const
+    {
+        std::vector<int> arguments;
+        for(const auto &argument : m_arguments)
+        {
+            if(auto range = dynamic_cast<const ASTNodeRange *>(argument))
+                arguments.push_back(formula.addRange(range->m_from, range->m_to));
+            else
+                arguments.push_back(-1);
+        }
+        formula.emitCall(m_function, std::move(arguments));
+    }
+
+
+#ifdef SPREADSHEET_PROFILE
+/**
+ * @brief Totals counted by a sheet since it was created or its profile was reset.
+ */
+struct CProfileStats
+{
+    uint64_t m_evaluations = 0;           ///< Number of formulas evaluated.
+    uint64_t m_evaluationNanoseconds = 0; ///< Time spent evaluating formulas, summed over all threads.
+    uint64_t m_cycleSteps = 0;            ///< Number of references followed while collecting outdated cells and checking them for cycles.
+    uint64_t m_referenceLookups = 0;      ///< Number of cell values read by references in formulas.
+    uint64_t m_nodeAllocations = 0;       ///< Number of syntax tree nodes the parser built.
+    uint64_t m_parsed = 0;                ///< Number of cell contents parsed.
+    uint64_t m_parseNanoseconds = 0;      ///< Time spent parsing cell contents, summed over all threads.
+};
+
+/**
+ * @brief Evaluation cost of one cell.
+ */
+struct CCellProfile
+{
+    CPos m_pos;                           ///< Position of the cell.
+    uint64_t m_evaluations = 0;           ///< Number of times its formula was evaluated.
+    uint64_t m_evaluationNanoseconds = 0; ///< Time spent evaluating its formula.
+};
+
+/**
+ * @brief Counters of a sheet, updated by any number of threads at once.
+ */
+struct CProfile
+{
+    /**
+     * @brief Read all counters.
+     *
+     * @return The totals.
+     */
+    CProfileStats stats() const
+    {
+        return { m_evaluations, m_evaluationNanoseconds, m_cycleSteps, m_referenceLookups, m_nodeAllocations, m_parsed, m_parseNanoseconds };
+    }
+
+    std::atomic<uint64_t> m_evaluations {0};
+    std::atomic<uint64_t> m_evaluationNanoseconds {0};
+    std::atomic<uint64_t> m_cycleSteps {0};
+    std::atomic<uint64_t> m_referenceLookups {0};
+    std::atomic<uint64_t> m_nodeAllocations {0};
+    std::atomic<uint64_t> m_parsed {0};
+    std::atomic<uint64_t> m_parseNanoseconds {0};
+};
+
+/**
+ * @brief Get the time since an earlier point in nanoseconds.
+ *
+ * @param start The earlier point.
+ * @return The elapsed time.
+ */
+inline uint64_t nanosecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
+#endif
+
+
+/**
+ * @brief Cell of the table with its compiled formula and the state of its cached value.
+ */
+struct CCell
+{
+    std::shared_ptr<const CFormula> m_formula; ///< Contents of the cell relative to its position, shared by cells with equal contents.
+    CCellValue m_value; ///< Cached result of the last evaluation.
+    bool m_dirty = true; ///< True if m_value and m_cyclic are out of date and have to be evaluated again.
+    bool m_cyclic = false; ///< True if a cycle is reachable from this cell through its references, m_value is empty then.
+    PROFILE_ONLY(uint64_t m_evaluations = 0;) ///< Number of times the formula was evaluated.
+    PROFILE_ONLY(uint64_t m_evaluationNanoseconds = 0;) ///< Time spent evaluating the formula.
+};
+
+
+/**
+ * @brief Numbers cached in CHUNK_SIZE vertically neighbouring cells of one column.
+ *
+ * CCells keeps a copy of every cached number in these chunks, so range functions scan flat arrays
+ * of doubles instead of visiting the cells one by one.
+ */
+struct CNumberChunk
+{
+    static constexpr int CHUNK_BITS = 6;
+    static constexpr int CHUNK_SIZE = 1 << CHUNK_BITS;
+
+    double m_numbers[CHUNK_SIZE] = {};   ///< Cached numbers, 0 where the cell holds no number.
+    uint8_t m_isNumber[CHUNK_SIZE] = {}; ///< 1 where the cell holds a number, 0 elsewhere.
+    unsigned m_count = 0;                ///< Number of cells holding a number.
+};
+
+
+/**
+ * @brief Sparse two-dimensional storage indexed by CPos with copy-on-write sharing.
+ *
+ * The plane is split into tiles of TILE_SIZE x TILE_SIZE positions. A tile keeps its first
+ * elements in a short unordered list. Once it holds PROMOTE_COUNT of them it becomes dense: every
+ * column of the tile that is in use gets a flat array of TILE_SIZE elements, so vertically
+ * neighbouring cells share cache lines and a lookup is one hash probe plus an array access.
+ *
+ * Copies of a grid share their tiles. The first modification of a copy duplicates the table of
+ * tiles, which only holds pointers, and every modification duplicates the tile it touches if that
+ * tile is still shared, so the copies only pay for the tiles in which they differ.
+ * Inserting or erasing may move the other elements of the same tile, reading never moves any.
+ */
+template <typename T>
+class CGrid
+{
+public:
+    /**
+     * @brief Get the element at the given position for reading.
+     *
+     * @param pos Position of the element.
+     * @return Pointer to the element, or nullptr if there is none.
+     */
+    const T *find(const CPos &pos) const;
+
+    /**
+     * @brief Get the element at the given position for writing, unsharing its tile first.
+     *
+     * @param pos Position of the element.
+     * @return Pointer to the element, or nullptr if there is none.
+     */
+    T *modify(const CPos &pos);
+
+    /**
+     * @brief Get the element at the given position for writing, inserting a default one if there is none.
+     *
+     * @param pos Position of the element.
+     * @return Reference to the element.
+     */
+    T &operator[](const CPos &pos);
+
+    /**
+     * @brief Remove the element at the given position.
+     *
+     * @param pos Position of the element.
+     * @return True if there was an element to remove.
+     */
+    bool erase(const CPos &pos);
+
+    /**
+     * @brief Check whether the grid has no elements.
+     *
+     * @return True if the grid is empty.
+     */
+    bool empty() const;
+
+    /**
+     * @brief Call fn(pos, element) for every element in no particular order.
+     *
+     * @param fn Function to call.
+     */
+    template <typename F>
+    void forEach(F &&fn) const
+    {
+        for(const auto &[key, tile] : *m_tiles)
+            tile->forEachIn(CRange(tile->m_origin, tile->m_origin + std::make_pair(TILE_SIZE - 1, TILE_SIZE - 1)), fn);
+    }
+
+    /**
+     * @brief Call fn(pos, element) for every element ordered by column first and row second.
+     *
+     * @param fn Function to call.
+     */
+    template <typename F>
+    void forEachOrdered(F &&fn) const
+    {
+        std::vector<std::pair<CPos, const T *>> elements;
+        forEach([&elements](const CPos &pos, const T &element) { elements.emplace_back(pos, &element); });
+        std::sort(elements.begin(), elements.end(), [](const auto &a, const auto &b) { return a.first.getKey() < b.first.getKey(); });
+        for(const auto &[pos, element] : elements)
+            fn(pos, *element);
+    }
+
+    /**
+     * @brief Call fn(pos, element) for every element inside the range in no particular order.
+     *
+     * Either probes the tiles the range overlaps or scans all tiles, whichever touches fewer of them.
+     *
+     * @param range The range.
+     * @param fn Function to call.
+     */
+    template <typename F>
+    void forEachIn(const CRange &range, F &&fn) const
+    {
+        auto firstColumn = range.m_from.getColumn() >> TILE_BITS, lastColumn = range.m_to.getColumn() >> TILE_BITS;
+        auto firstRow = range.m_from.getRow() >> TILE_BITS, lastRow = range.m_to.getRow() >> TILE_BITS;
+        auto tiles = static_cast<unsigned long long>(lastColumn - firstColumn + 1) * static_cast<unsigned long long>(lastRow - firstRow + 1);
+
+        if(tiles > m_tiles->size())
+        {
+            for(const auto &[key, tile] : *m_tiles)
+                tile->forEachIn(range, fn);
+            return;
+        }
+        for(auto column = firstColumn; column <= lastColumn; column++)
+        {
+            for(auto row = firstRow; row <= lastRow; row++)
+            {
+                if(auto tile = m_tiles->find(CPos(column, row).getKey()); tile != m_tiles->end())
+                    tile->second->forEachIn(range, fn);
+            }
+        }
+    }
+
+    static constexpr int TILE_BITS = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_BITS; ///< Width and height of a tile.
+    static constexpr size_t TILE_AREA = TILE_SIZE * TILE_SIZE;
+    static constexpr size_t PROMOTE_COUNT = TILE_SIZE; ///< Number of elements that turn a tile dense.
+
+private:
+    struct CTile
+    {
+        explicit CTile(const CPos &origin) : m_origin(origin) {}
+
+        CTile(const CTile &other) : m_origin(other.m_origin), m_sparseIndex(other.m_sparseIndex), m_sparse(other.m_sparse)
+        {
+            if(other.m_dense == nullptr)
+                return;
+            m_dense = std::make_unique<CDense>();
+            m_dense->m_used = other.m_dense->m_used;
+            m_dense->m_count = other.m_dense->m_count;
+            for(int column = 0; column < TILE_SIZE; column++)
+            {
+                if(other.m_dense->m_columns[column] != nullptr)
+                {
+                    m_dense->m_columns[column] = std::make_unique<T[]>(TILE_SIZE);
+                    std::copy_n(other.m_dense->m_columns[column].get(), TILE_SIZE, m_dense->m_columns[column].get());
+                }
+            }
+        }
+
+        static size_t index(const CPos &pos)
+        {
+            return (static_cast<size_t>(pos.getColumn() & (TILE_SIZE - 1)) << TILE_BITS) | static_cast<size_t>(pos.getRow() & (TILE_SIZE - 1));
+        }
+
+        const T *find(size_t index) const
+        {
+            if(m_dense != nullptr)
+                return m_dense->m_used[index] ? &m_dense->m_columns[index >> TILE_BITS][index & (TILE_SIZE - 1)] : nullptr;
+            for(size_t i = 0; i < m_sparseIndex.size(); i++)
+            {
+                if(m_sparseIndex[i] == index)
+                    return &m_sparse[i];
+            }
+            return nullptr;
+        }
+
+        /**
+         * @brief Get the element in the slot, inserting a default one if the slot is unused.
+         *
+         * @param index Index of the slot.
+         * @return The element.
+         */
+        T &insert(size_t index)
+        {
+            if(auto found = find(index))
+                return const_cast<T &>(*found);
+            if(m_dense == nullptr && m_sparse.size() + 1 < PROMOTE_COUNT)
+            {
+                m_sparseIndex.push_back(static_cast<uint16_t>(index));
+                return m_sparse.emplace_back();
+            }
+            if(m_dense == nullptr)
+                promote();
+            auto &column = m_dense->m_columns[index >> TILE_BITS];
+            if(column == nullptr)
+                column = std::make_unique<T[]>(TILE_SIZE);
+            m_dense->m_used[index] = true;
+            m_dense->m_count++;
+            return column[index & (TILE_SIZE - 1)];
+        }
+
+        /**
+         * @brief Remove the element in the slot.
+         *
+         * @param index Index of the slot.
+         * @return True if the slot was used.
+         */
+        bool erase(size_t index)
+        {
+            if(m_dense != nullptr)
+            {
+                if(!m_dense->m_used[index])
+                    return false;
+                m_dense->m_used[index] = false;
+                m_dense->m_count--;
+                m_dense->m_columns[index >> TILE_BITS][index & (TILE_SIZE - 1)] = T {};
+                return true;
+            }
+            for(size_t i = 0; i < m_sparseIndex.size(); i++)
+            {
+                if(m_sparseIndex[i] != index)
+                    continue;
+                m_sparseIndex[i] = m_sparseIndex.back();
+                m_sparseIndex.pop_back();
+                if(i + 1 < m_sparse.size())
+                    m_sparse[i] = std::move(m_sparse.back());
+                m_sparse.pop_back();
+                return true;
+            }
+            return false;
+        }
+
+        bool empty() const
+        {
+            return m_dense == nullptr ? m_sparse.empty() : m_dense->m_count == 0;
+        }
+
+        /**
+         * @brief Move the elements from the unordered list into dense columns.
+         */
+        void promote()
+        {
+            m_dense = std::make_unique<CDense>();
+            for(size_t i = 0; i < m_sparseIndex.size(); i++)
+            {
+                auto index = m_sparseIndex[i];
+                auto &column = m_dense->m_columns[index >> TILE_BITS];
+                if(column == nullptr)
+                    column = std::make_unique<T[]>(TILE_SIZE);
+                column[index & (TILE_SIZE - 1)] = std::move(m_sparse[i]);
+                m_dense->m_used[index] = true;
+                m_dense->m_count++;
+            }
+            m_sparseIndex.clear();
+            m_sparseIndex.shrink_to_fit();
+            m_sparse.clear();
+            m_sparse.shrink_to_fit();
+        }
+
+        /**
+         * @brief Call fn(pos, element) for every element of the tile inside the range.
+         *
+         * Each dense column is a contiguous array, so its elements are visited in memory order.
+         */
+        template <typename F>
+        void forEachIn(const CRange &range, F &fn) const
+        {
+            auto originColumn = m_origin.getColumn(), originRow = m_origin.getRow();
+            if(!range.overlaps(CRange(m_origin, m_origin + std::make_pair(TILE_SIZE - 1, TILE_SIZE - 1))))
+                return;
+            if(m_dense == nullptr)
+            {
+                for(size_t i = 0; i < m_sparseIndex.size(); i++)
+                {
+                    CPos pos(originColumn + (m_sparseIndex[i] >> TILE_BITS), originRow + (m_sparseIndex[i] & (TILE_SIZE - 1)));
+                    if(range.contains(pos))
+                        fn(pos, m_sparse[i]);
+                }
+                return;
+            }
+            auto fromColumn = std::max(range.m_from.getColumn(), originColumn), toColumn = std::min(range.m_to.getColumn(), originColumn + TILE_SIZE - 1);
+            auto fromRow = std::max(range.m_from.getRow(), originRow), toRow = std::min(range.m_to.getRow(), originRow + TILE_SIZE - 1);
+            for(auto column = fromColumn; column <= toColumn; column++)
+            {
+                const auto &elements = m_dense->m_columns[column - originColumn];
+                if(elements == nullptr)
+                    continue;
+                for(auto row = fromRow; row <= toRow; row++)
+                {
+                    auto slot = (static_cast<size_t>(column - originColumn) << TILE_BITS) | static_cast<size_t>(row - originRow);
+                    if(m_dense->m_used[slot])
+                        fn(CPos(column, row), elements[row - originRow]);
+                }
+            }
+        }
+
+        struct CDense
+        {
+            std::array<std::unique_ptr<T[]>, TILE_SIZE> m_columns; ///< Elements of each column, nullptr for unused columns.
+            std::bitset<TILE_AREA> m_used;
+            size_t m_count = 0; ///< Number of set bits in m_used.
+        };
+
+        CPos m_origin; ///< Position of the top left corner.
+        std::vector<uint16_t> m_sparseIndex; ///< Slots of the elements in m_sparse while the tile is not dense.
+        std::vector<T> m_sparse;
+        std::unique_ptr<CDense> m_dense; ///< Elements of a dense tile, nullptr until the tile becomes dense.
+    };
+
+    using CTileMap = std::unordered_map<uint64_t, std::shared_ptr<CTile>>;
+
+    static uint64_t tileKey(const CPos &pos)
+    {
+        return CPos(pos.getColumn() >> TILE_BITS, pos.getRow() >> TILE_BITS).getKey();
+    }
+
+    /**
+     * @brief Get the tile containing pos for writing, unsharing the table of tiles and the tile first.
+     *
+     * @param pos Any position inside the tile.
+     * @param create True to create the tile if it does not exist.
+     * @return The tile, or nullptr if it does not exist and create is false.
+     */
+    CTile *modifyTile(const CPos &pos, bool create);
+
+    std::shared_ptr<CTileMap> m_tiles = std::make_shared<CTileMap>(); ///< Tiles by tileKey.
+};
+
+
+template <typename T>
+const T *CGrid<T>::find(const CPos &pos) const
+{
+    auto tile = m_tiles->find(tileKey(pos));
+    if(tile == m_tiles->end())
+        return nullptr;
+    return tile->second->find(CTile::index(pos));
+}
+
+template <typename T>
+T *CGrid<T>::modify(const CPos &pos)
+{
+    if(find(pos) == nullptr)
+        return nullptr;
+    return const_cast<T *>(modifyTile(pos, false)->find(CTile::index(pos)));
+}
+
+template <typename T>
+T &CGrid<T>::operator[](const CPos &pos)
+{
+    return modifyTile(pos, true)->insert(CTile::index(pos));
+}
+
+template <typename T>
+bool CGrid<T>::erase(const CPos &pos)
+{
+    if(find(pos) == nullptr)
+        return false;
+    auto tile = modifyTile(pos, false);
+    tile->erase(CTile::index(pos));
+    if(tile->empty())
+        m_tiles->erase(tileKey(pos));
+    return true;
+}
+
+template <typename T>
+bool CGrid<T>::empty() const
+{
+    return m_tiles->empty();
+}
+
+template <typename T>
+typename CGrid<T>::CTile *CGrid<T>::modifyTile(const CPos &pos, bool create)
+{
+    // A copy on another thread may have just dropped its reference. The fences make everything it
+    // read before that visible here, before this grid writes in place to what it no longer shares.
+    if(m_tiles.use_count() > 1)
+        m_tiles = std::make_shared<CTileMap>(*m_tiles);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    auto key = tileKey(pos);
+    auto tile = m_tiles->find(key);
+    if(tile == m_tiles->end())
+    {
+        if(!create)
+            return nullptr;
+        CPos origin((pos.getColumn() >> TILE_BITS) << TILE_BITS, (pos.getRow() >> TILE_BITS) << TILE_BITS);
+        tile = m_tiles->emplace(key, std::make_shared<CTile>(origin)).first;
+    }
+    else if(tile->second.use_count() > 1)
+        tile->second = std::make_shared<CTile>(*tile->second);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return tile->second.get();
+}
+
+
+/**
+ * @brief Index of ranges and the cells using them, answering which ranges contain a position.
+ *
+ * A range is kept in every tile it overlaps. Along each axis the tiles are 2^bits cells long,
+ * where bits grows with the length of the range until it overlaps at most MAX_TILES tiles, and
+ * ranges with the same tile size share a grid. A range in one column lands in tiles one column
+ * wide, a long one in tiles thousands of rows high. A lookup probes one tile in each grid in use,
+ * so it only visits ranges that contain the position or lie close to it compared to their size.
+ */
+class CRangeIndex
+{
+public:
+    /**
+     * @brief Add a range used by a cell.
+     *
+     * @param range The range.
+     * @param dependent Position of the cell using it.
+     */
+    void insert(const CRange &range, const CPos &dependent);
+
+    /**
+     * @brief Remove a range added by insert, nothing happens if it is not there.
+     *
+     * @param range The range.
+     * @param dependent Position of the cell using it.
+     */
+    void erase(const CRange &range, const CPos &dependent);
+
+    /**
+     * @brief Call fn(range, dependent) once for every added range containing pos.
+     *
+     * @param pos The position.
+     * @param fn Function to call.
+     */
+    template <typename F>
+    void forEachContaining(const CPos &pos, F &&fn) const
+    {
+        for(const auto &[bits, grid] : m_grids)
+        {
+            if(auto entries = grid.find(tile(pos, bits.first, bits.second)))
+            {
+                for(const auto &[dependent, range] : *entries)
+                {
+                    if(range.contains(pos))
+                        fn(range, dependent);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Call fn(range, dependent) for every added range overlapping an area.
+     *
+     * A range is reported once for each tile it shares with the area, so it may be reported
+     * several times.
+     *
+     * @param area The area.
+     * @param fn Function to call.
+     */
+    template <typename F>
+    void forEachOverlapping(const CRange &area, F &&fn) const
+    {
+        for(const auto &[bits, grid] : m_grids)
+        {
+            CRange tiles(tile(area.m_from, bits.first, bits.second), tile(area.m_to, bits.first, bits.second));
+            grid.forEachIn(tiles, [&area, &fn](const CPos &, const CEntries &entries)
+            {
+                for(const auto &[dependent, range] : entries)
+                {
+                    if(range.overlaps(area))
+                        fn(range, dependent);
+                }
+            });
+        }
+    }
+
+    static constexpr int BITS_STEP = 2;  ///< Each coarser tile size is 4 times as long.
+    static constexpr int MAX_BITS = 30;  ///< Tiles of 2^30 cells cover any coordinate with four tiles.
+    static constexpr long long MAX_TILES = 8; ///< Largest number of tiles a range overlaps along each axis.
+
+private:
+    using CEntries = std::multimap<CPos, CRange, CPosComparator>; ///< Ranges in a tile by the cells using them.
+
+    /**
+     * @brief Get the smallest tile length for which a span of coordinates overlaps at most MAX_TILES tiles.
+     *
+     * @param from First coordinate.
+     * @param to Last coordinate.
+     * @return Bits of the tile length.
+     */
+    static int bits(long long from, long long to);
+
+    /**
+     * @brief Get the position of the tile containing a cell.
+     *
+     * @param pos Position of the cell.
+     * @param columnBits Bits of the tile width.
+     * @param rowBits Bits of the tile height.
+     * @return Position of the tile.
+     */
+    static CPos tile(const CPos &pos, int columnBits, int rowBits);
+
+    /**
+     * @brief Call fn(tile) for the position of every tile the range overlaps.
+     *
+     * @param range The range.
+     * @param columnBits Bits of the tile width.
+     * @param rowBits Bits of the tile height.
+     * @param fn Function to call.
+     */
+    template <typename F>
+    static void forEachTile(const CRange &range, int columnBits, int rowBits, F &&fn)
+    {
+        for(auto column = range.m_from.getColumn() >> columnBits; column <= range.m_to.getColumn() >> columnBits; column++)
+        {
+            for(auto row = range.m_from.getRow() >> rowBits; row <= range.m_to.getRow() >> rowBits; row++)
+                fn(CPos(column, row));
+        }
+    }
+
+    std::map<std::pair<int, int>, CGrid<CEntries>> m_grids; ///< Grids in use by the bits of their tile width and height.
+};
+
+
+int CRangeIndex::bits(long long from, long long to)
+{
+    int result = 0;
+    while(result < MAX_BITS && (to >> result) - (from >> result) + 1 > MAX_TILES)
+        result += BITS_STEP;
+    return result;
+}
+
+CPos CRangeIndex::tile(const CPos &pos, int columnBits, int rowBits)
+{
+    return CPos(pos.getColumn() >> columnBits, pos.getRow() >> rowBits);
+}
+
+void CRangeIndex::insert(const CRange &range, const CPos &dependent)
+{
+    auto columnBits = bits(range.m_from.getColumn(), range.m_to.getColumn());
+    auto rowBits = bits(range.m_from.getRow(), range.m_to.getRow());
+    auto &grid = m_grids[{columnBits, rowBits}];
+    forEachTile(range, columnBits, rowBits, [&grid, &range, &dependent](const CPos &key)
+    {
+        grid[key].emplace(dependent, range);
+    });
+}
+
+void CRangeIndex::erase(const CRange &range, const CPos &dependent)
+{
+    auto columnBits = bits(range.m_from.getColumn(), range.m_to.getColumn());
+    auto rowBits = bits(range.m_from.getRow(), range.m_to.getRow());
+    auto grid = m_grids.find({columnBits, rowBits});
+    if(grid == m_grids.end())
+        return;
+    forEachTile(range, columnBits, rowBits, [&grid, &range, &dependent](const CPos &key)
+    {
+        auto entries = grid->second.modify(key);
+        if(entries == nullptr)
+            return;
+        auto [first, last] = entries->equal_range(dependent);
+        auto found = std::find_if(first, last, [&range](const auto &entry) { return entry.second == range; });
+        if(found == last)
+            return;
+        entries->erase(found);
+        if(entries->empty())
+            grid->second.erase(key);
+    });
+    if(grid->second.empty())
+        m_grids.erase(grid);
+}
+
+
+/**
+ * @brief Table of cells with memoized evaluation and an index of the dependencies between them.
+ *
+ * A clean cell only ever depends on clean cells, cyclic cells are clean as well once their cycle
+ * was found. A write therefore marks the written cell and its transitive dependents dirty and
+ * stops at the first dependent that is already dirty.
+ *
+ * The cells and the dependency index are all kept in CGrid, so copies of a table share them until
+ * either copy writes. Everything that changes a cell, including caching its value, goes through
+ * the writing accessors of the grid.
+ */
+struct CCells
+{
+    /**
+     * @brief Get the cached value of the cell at the given position.
+     *
+     * Formulas are evaluated in dependency order by recalculate, so every cell a formula
+     * references is already up to date when the formula reads it.
+     *
+     * @param pos Position of the cell.
+     * @return The value of the cell.
+     */
+    const CCellValue &evaluate(const CPos &pos) const;
+
+    /**
+     * @brief Get the cell at the given position if its value has to be recalculated.
+     *
+     * @param pos Position of the cell.
+     * @return Pointer to the cell, or nullptr if it is missing or up to date.
+     */
+    const CCell *findOutdated(const CPos &pos) const;
+
+    /**
+     * @brief Bring the given cells and everything they depend on up to date.
+     *
+     * The outdated cells reachable from targets are sorted topologically once and each of them is
+     * evaluated exactly once, without recursing through references. Cells that never become ready
+     * lie on or behind a cycle and are marked cyclic, which keeps them up to date with an empty
+     * value until one of their precedents changes. Up to date cells are not visited at all.
+     *
+     * @param targets Positions of the cells to bring up to date.
+     */
+    void recalculate(const std::vector<CPos> &targets);
+
+    /**
+     * @brief Bring all outdated cells up to date.
+     */
+    void recalculate();
+
+    /**
+     * @brief Determine whether the cell is cyclic and evaluate it if it is not.
+     *
+     * All precedents of the cell have to be up to date already. Only the cell itself is written,
+     * so cells of the same topological level can be updated from several threads at once.
+     *
+     * @param pos Position of the cell.
+     * @param cell The cell.
+     */
+    void updateCell(const CPos &pos, CCell &cell) const;
+
+    /**
+     * @brief Set the number of threads used to evaluate independent cells during recalculation.
+     *
+     * @param threads Number of threads, 1 evaluates everything on the calling thread.
+     */
+    void setThreadCount(unsigned threads);
+
+    static constexpr size_t PARALLEL_LEVEL_SIZE = 256; ///< Smallest topological level evaluated in parallel.
+
+    /**
+     * @brief Re-read the references of the cell at the given position and update the dependency index.
+     *
+     * Has to be called whenever the formula at pos is replaced or erased.
+     *
+     * @param pos Position of the cell.
+     */
+    void updateDependencies(const CPos &pos);
+
+    /**
+     * @brief Mark the cell at the given position and all cells depending on it dirty.
+     *
+     * @param pos Position of the changed cell.
+     */
+    void invalidate(const CPos &pos);
+
+    /**
+     * @brief Mark the cells at the given positions and all cells depending on them dirty.
+     *
+     * Cells depending on several of them are visited once.
+     *
+     * @param positions Positions of the changed cells.
+     */
+    void invalidate(const std::vector<CPos> &positions);
+
+    /**
+     * @brief Mirror the cached value of a cell into m_numbers, has to be called whenever it changes.
+     *
+     * @param pos Position of the cell.
+     * @param value The new value, empty for an erased cell.
+     */
+    void storeNumber(const CPos &pos, const CCellValue &value);
+
+    /**
+     * @brief Get the key of the chunk of m_numbers holding the given position.
+     *
+     * @param pos Position of a cell.
+     * @return Column of the cell and the index of its chunk within the column.
+     */
+    static CPos numberChunk(const CPos &pos);
+
+    /**
+     * @brief Get a shared formula equal to the given one, reusing the one of another cell if possible.
+     *
+     * @param formula Formula already converted by CFormula::toRelative.
+     * @return The shared formula.
+     */
+    std::shared_ptr<const CFormula> intern(CFormula formula);
+
+    /**
+     * @brief Call fn(ref) for every cell the formula at pos depends on.
+     *
+     * Single references are reported whether the cell exists or not, cells of ranges only if they exist.
+     * A cell is reported once for each range and reference it is part of.
+     *
+     * @param pos Position of the cell.
+     * @param fn Function to call.
+     */
+    template <typename F>
+    void forEachPrecedent(const CPos &pos, F &&fn) const
+    {
+        if(auto precedents = m_precedents.find(pos))
+        {
+            for(const auto &ref : *precedents)
+                fn(ref);
+        }
+        if(auto ranges = m_precedentRanges.find(pos))
+        {
+            for(const auto &range : *ranges)
+                m_cells.forEachIn(range, [&fn](const CPos &ref, const CCell &) { fn(ref); });
+        }
+    }
+
+    /**
+     * @brief Call fn(dependent) for every cell whose formula depends on pos.
+     *
+     * A dependent is reported once for each range and reference of it that pos is part of,
+     * matching forEachPrecedent.
+     *
+     * @param pos Position of the cell.
+     * @param fn Function to call.
+     */
+    template <typename F>
+    void forEachDependent(const CPos &pos, F &&fn) const
+    {
+        if(auto dependents = m_dependents.find(pos))
+        {
+            for(const auto &dependent : *dependents)
+                fn(dependent);
+        }
+        m_rangeDependents.forEachContaining(pos, [&fn](const CRange &, const CPos &dependent) { fn(dependent); });
+    }
+
+
+    CGrid<CCell> m_cells;
+    CGrid<std::set<CPos, CPosComparator>> m_dependents; ///< Cells whose formulas reference the position, which does not have to exist.
+    CGrid<std::vector<CPos>> m_precedents; ///< Cells referenced by the formula at the position.
+    CGrid<std::vector<CRange>> m_precedentRanges; ///< Ranges used by the formula at the position.
+    CRangeIndex m_rangeDependents; ///< Ranges and the cells using them.
+    CGrid<CNumberChunk> m_numbers; ///< Cached numbers of the cells by numberChunk, read by range functions.
+    std::unordered_map<size_t, std::vector<std::weak_ptr<const CFormula>>> m_formulas; ///< Formulas in use by their hash, for intern.
+    std::unique_ptr<CWorkerPool> m_pool; ///< Threads for parallel recalculation, nullptr if it is disabled.
+    CArena m_nodes; ///< Syntax tree of the formula being parsed.
+    PROFILE_ONLY(mutable CProfile m_profile;) ///< What evaluation and parsing did so far.
+};
+
+
+
+CCellValue CFormula::evaluate(const CCells &table, const CPos &anchor) const
+{
+    if(m_code.empty())
+        return CCellValue {};
+
+    CCellValue smallStack[SMALL_STACK];
+    std::vector<CCellValue> largeStack;
+    CCellValue *stack = smallStack;
+    if(m_stackSize > SMALL_STACK)
+    {
+        largeStack.resize(m_stackSize);
+        stack = largeStack.data();
+    }
+
+    size_t top = 0;
+    for(const auto &instr : m_code)
+    {
+        switch(instr.m_op)
+        {
+            case OP_NUMBER:
+                stack[top++] = instr.m_number;
+                break;
+            case OP_STRING:
+                stack[top++] = m_strings[instr.m_arg];
+                break;
+            case OP_REFERENCE:
+                PROFILE_COUNT(table.m_profile.m_referenceLookups, 1);
+                stack[top++] = table.evaluate(resolve(m_references[instr.m_arg], anchor));
+                break;
+            case OP_NEG:
+                if(auto value = std::get_if<double>(&stack[top - 1]))
+                    *value = -*value;
+                else
+                    stack[top - 1] = CCellValue {};
+                break;
+            case OP_CALL:
+            {
+                const auto &called = m_calls[instr.m_arg];
+                auto values = static_cast<size_t>(std::count(called.m_arguments.begin(), called.m_arguments.end(), -1));
+                top -= values;
+                stack[top] = call(called, stack + top, table, anchor);
+                top++;
+                break;
+            }
+            default:
+                top--;
+                stack[top - 1] = apply(instr.m_op, stack[top - 1], stack[top]);
+                break;
+        }
+    }
+    return std::move(stack[0]);
+}
+
+CCellValue CFormula::call(const CCall &call, const CCellValue *values, const CCells &table, const CPos &anchor) const
+{
+    // Independent partial sums let the additions of consecutive cells overlap.
+    double sums[4] = {0, 0, 0, 0};
+    double minimum = std::numeric_limits<double>::infinity();
+    double maximum = -std::numeric_limits<double>::infinity();
+    size_t count = 0;
+    auto add = [&sums, &minimum, &maximum, &count](const CCellValue &value)
+    {
+        if(auto number = std::get_if<double>(&value))
+        {
+            sums[count & 3] += *number;
+            minimum = std::min(minimum, *number);
+            maximum = std::max(maximum, *number);
+            count++;
+        }
+    };
+
+    for(const auto &argument : call.m_arguments)
+    {
+        if(argument < 0)
+        {
+            add(*values++);
+            continue;
+        }
+        // Ranges are read from the number chunks. The slots without a number hold 0, so the sums
+        // need no branches, and the loops over a chunk can be vectorized.
+        const auto &range = m_ranges[argument];
+        CRange cells(resolve(range.m_from, anchor), resolve(range.m_to, anchor));
+        auto firstRow = cells.m_from.getRow(), lastRow = cells.m_to.getRow();
+        CRange chunks(CCells::numberChunk(cells.m_from), CCells::numberChunk(cells.m_to));
+        table.m_numbers.forEachIn(chunks, [&sums, &minimum, &maximum, &count, firstRow, lastRow](const CPos &key, const CNumberChunk &chunk)
+        {
+            auto base = key.getRow() << CNumberChunk::CHUNK_BITS;
+            auto begin = static_cast<int>(std::max<long long>(firstRow - base, 0));
+            auto end = static_cast<int>(std::min<long long>(lastRow - base + 1, CNumberChunk::CHUNK_SIZE));
+            double partial[4] = {0, 0, 0, 0};
+            double low = std::numeric_limits<double>::infinity();
+            double high = -std::numeric_limits<double>::infinity();
+            unsigned numbers = 0;
+            for(int i = begin; i < end; i++)
+            {
+                auto value = chunk.m_numbers[i];
+                bool isNumber = chunk.m_isNumber[i] != 0;
+                partial[i & 3] += value;
+                low = std::min(low, isNumber ? value : std::numeric_limits<double>::infinity());
+                high = std::max(high, isNumber ? value : -std::numeric_limits<double>::infinity());
+                numbers += chunk.m_isNumber[i];
+            }
+            for(int i = 0; i < 4; i++)
+                sums[i] += partial[i];
+            minimum = std::min(minimum, low);
+            maximum = std::max(maximum, high);
+            count += numbers;
+        });
+    }
+
+    if(call.m_function == FN_COUNT)
+        return static_cast<double>(count);
+    if(count == 0)
+        return CCellValue {};
+    switch(call.m_function)
+    {
+        case FN_SUM: return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+        case FN_AVERAGE: return ((sums[0] + sums[1]) + (sums[2] + sums[3])) / static_cast<double>(count);
+        case FN_MIN: return minimum;
+        case FN_MAX: return maximum;
+        default: return CCellValue {};
+    }
+}
+
+const CCellValue &CCells::evaluate(const CPos &pos) const
+{
+    static const CCellValue empty;
+    auto cell = m_cells.find(pos);
+    if(cell == nullptr)
+        return empty;
+    return cell->m_value;
+}
+
+const CCell *CCells::findOutdated(const CPos &pos) const
+{
+    auto cell = m_cells.find(pos);
+    if(cell == nullptr || !cell->m_dirty)
+        return nullptr;
+    return cell;
+}
+
+void CCells::recalculate(const std::vector<CPos> &targets)
+{
+    // Collect the outdated part of the graph, counting for each cell its outdated precedents.
+    std::map<CPos, size_t, CPosComparator> pending;
+    std::stack<CPos> toVisit;
+    for(const auto &target : targets)
+    {
+        if(findOutdated(target) != nullptr && pending.emplace(target, 0).second)
+            toVisit.push(target);
+    }
+    while(!toVisit.empty())
+    {
+        auto current = toVisit.top();
+        toVisit.pop();
+        forEachPrecedent(current, [this, &current, &pending, &toVisit](const CPos &ref)
+        {
+            PROFILE_COUNT(m_profile.m_cycleSteps, 1);
+            if(findOutdated(ref) == nullptr)
+                return;
+            pending[current]++;
+            if(pending.emplace(ref, 0).second)
+                toVisit.push(ref);
+        });
+    }
+
+    // Evaluate the cells level by level in topological order, so every reference reads an up to
+    // date value and the cells of one level can be evaluated in parallel.
+    // Whatever is left over lies on or behind a cycle.
+    std::vector<std::pair<CPos, CCell *>> level;
+    for(const auto &[cellPos, count] : pending)
+    {
+        if(count == 0)
+            level.emplace_back(cellPos, m_cells.modify(cellPos));
+    }
+    while(!level.empty())
+    {
+        if(m_pool != nullptr && level.size() >= PARALLEL_LEVEL_SIZE)
+        {
+            m_pool->parallelFor(level.size(), [this, &level](size_t begin, size_t end)
+            {
+                for(size_t i = begin; i < end; i++)
+                    updateCell(level[i].first, *level[i].second);
+            });
+        }
+        else
+        {
+            for(const auto &[cellPos, cell] : level)
+                updateCell(cellPos, *cell);
+        }
+
+        std::vector<std::pair<CPos, CCell *>> next;
+        for(const auto &[cellPos, cell] : level)
+        {
+            storeNumber(cellPos, cell->m_value);
+            pending.erase(cellPos);
+            forEachDependent(cellPos, [this, &pending, &next](const CPos &dependent)
+            {
+                if(auto waiting = pending.find(dependent); waiting != pending.end() && --waiting->second == 0)
+                    next.emplace_back(dependent, m_cells.modify(dependent));
+            });
+        }
+        level.swap(next);
+    }
+    for(const auto &[cellPos, count] : pending)
+    {
+        auto cell = m_cells.modify(cellPos);
+        cell->m_value = CCellValue {};
+        cell->m_cyclic = true;
+        cell->m_dirty = false;
+        storeNumber(cellPos, cell->m_value);
+    }
+}
+
+CPos CCells::numberChunk(const CPos &pos)
+{
+    return CPos(pos.getColumn(), pos.getRow() >> CNumberChunk::CHUNK_BITS);
+}
+
+void CCells::storeNumber(const CPos &pos, const CCellValue &value)
+{
+    auto key = numberChunk(pos);
+    auto slot = pos.getRow() & (CNumberChunk::CHUNK_SIZE - 1);
+    auto number = std::get_if<double>(&value);
+    if(number == nullptr)
+    {
+        auto found = m_numbers.find(key);
+        if(found == nullptr || !found->m_isNumber[slot])
+            return;
+        auto chunk = m_numbers.modify(key);
+        chunk->m_numbers[slot] = 0;
+        chunk->m_isNumber[slot] = 0;
+        if(--chunk->m_count == 0)
+            m_numbers.erase(key);
+        return;
+    }
+    auto &chunk = m_numbers[key];
+    if(!chunk.m_isNumber[slot])
+    {
+        chunk.m_isNumber[slot] = 1;
+        chunk.m_count++;
+    }
+    chunk.m_numbers[slot] = *number;
+}
+
+void CCells::updateCell(const CPos &pos, CCell &cell) const
+{
+    cell.m_cyclic = false;
+    forEachPrecedent(pos, [this, &cell](const CPos &ref)
+    {
+        PROFILE_COUNT(m_profile.m_cycleSteps, 1);
+        if(auto found = m_cells.find(ref); found != nullptr && found->m_cyclic)
+            cell.m_cyclic = true;
+    });
+    cell.m_dirty = false;
+    if(cell.m_cyclic)
+        cell.m_value = CCellValue {};
+    else
+    {
+        PROFILE_ONLY(auto start = std::chrono::steady_clock::now();)
+        cell.m_value = cell.m_formula->evaluate(*this, pos);
+#ifdef SPREADSHEET_PROFILE
+        auto elapsed = nanosecondsSince(start);
+        cell.m_evaluations++;
+        cell.m_evaluationNanoseconds += elapsed;
+        PROFILE_COUNT(m_profile.m_evaluations, 1);
+        PROFILE_COUNT(m_profile.m_evaluationNanoseconds, elapsed);
+#endif
+    }
+}
+
+void CCells::setThreadCount(unsigned threads)
+{
+    if(threads <= 1)
+        m_pool.reset();
+    else if(m_pool == nullptr || m_pool->size() != threads)
+        m_pool = std::make_unique<CWorkerPool>(threads);
+}
+
+void CCells::recalculate()
+{
+    std::vector<CPos> targets;
+    m_cells.forEach([&targets](const CPos &pos, const CCell &cell)
+    {
+        if(cell.m_dirty)
+            targets.push_back(pos);
+    });
+    recalculate(targets);
+}
+
+void CCells::updateDependencies(const CPos &pos)
+{
+    if(auto precedents = m_precedents.find(pos))
+    {
+        for(const auto &ref : *precedents)
+        {
+            auto dependents = m_dependents.modify(ref);
+            dependents->erase(pos);
+            if(dependents->empty())
+                m_dependents.erase(ref);
+        }
+    }
+
+    if(auto ranges = m_precedentRanges.find(pos))
+    {
+        for(const auto &range : *ranges)
+            m_rangeDependents.erase(range, pos);
+    }
+
+    std::vector<CPos> precedents;
+    std::vector<CRange> ranges;
+    if(auto cell = m_cells.find(pos))
+    {
+        cell->m_formula->collectReferences(precedents, pos);
+        cell->m_formula->collectRanges(ranges, pos);
+    }
+
+    if(precedents.empty())
+        m_precedents.erase(pos);
+    else
+    {
+        std::sort(precedents.begin(), precedents.end(), CPosComparator());
+        precedents.erase(std::unique(precedents.begin(), precedents.end()), precedents.end());
+        for(const auto &ref : precedents)
+            m_dependents[ref].insert(pos);
+        m_precedents[pos] = std::move(precedents);
+    }
+
+    if(ranges.empty())
+    {
+        m_precedentRanges.erase(pos);
+        return;
+    }
+    std::sort(ranges.begin(), ranges.end());
+    ranges.erase(std::unique(ranges.begin(), ranges.end()), ranges.end());
+    for(const auto &range : ranges)
+        m_rangeDependents.insert(range, pos);
+    m_precedentRanges[pos] = std::move(ranges);
+}
+
+std::shared_ptr<const CFormula> CCells::intern(CFormula formula)
+{
+    auto &candidates = m_formulas[formula.hash()];
+    std::shared_ptr<const CFormula> result;
+    for(auto it = candidates.begin(); it != candidates.end();)
+    {
+        auto candidate = it->lock();
+        if(candidate == nullptr)
+        {
+            it = candidates.erase(it);
+            continue;
+        }
+        if(result == nullptr && *candidate == formula)
+            result = std::move(candidate);
+        ++it;
+    }
+    if(result != nullptr)
+        return result;
+
+    formula.m_code.shrink_to_fit();
+    result = std::make_shared<const CFormula>(std::move(formula));
+    candidates.push_back(result);
+    return result;
+}
+
+void CCells::invalidate(const CPos &pos)
+{
+    invalidate(std::vector<CPos> {pos});
+}
+
+void CCells::invalidate(const std::vector<CPos> &positions)
+{
+    // All changed cells are marked first, so walking from one of them stops at the others and
+    // every dependent is pushed once.
+    for(const auto &pos : positions)
+    {
+        if(auto cell = m_cells.modify(pos))
+            cell->m_dirty = true;
+    }
+
+    std::stack<CPos, std::vector<CPos>> toVisit(positions);
+    while(!toVisit.empty())
+    {
+        auto current = toVisit.top();
+        toVisit.pop();
+        forEachDependent(current, [this, &toVisit](const CPos &dependent)
+        {
+            auto cell = m_cells.find(dependent);
+            if(cell == nullptr || cell->m_dirty)
+                return;
+            m_cells.modify(dependent)->m_dirty = true;
+            toVisit.push(dependent);
+        });
+    }
+}
+
+
+class CBuilder : public CExprBuilder
+{
+public:
+    CBuilder(CArena *nodes, bool isExp = false);
+
+    /**
+     * @brief Release the syntax tree built so far.
+     */
+    ~CBuilder() override;
+    void opAdd () override;
+    void opSub () override;
+    void opMul () override;
+    void opDiv () override;
+    void opPow () override;
+    void opNeg () override;
+    void opEq () override;
+    void opNe () override;
+    void opLt () override;
+    void opLe () override;
+    void opGt () override;
+    void opGe () override;
+    void valNumber (double val) override;
+    void valString (std::string val) override;
+    void valReference (std::string val) override;
+    void valRange (std::string val) override;
+    void funcCall (std::string fnName, int paramCount) override;
+    /**
+     * @brief Compile the parsed expression.
+     *
+     * @param isExp Flag indicating whether the cell contents start with '='.
+     * @return The compiled formula.
+     */
+    CFormula getFormula (bool isExp) const;
+private:
+    /**
+     * @brief Parse a cell reference with optional '$' prefixes of the column and the row.
+     *
+     * @param val The reference, e.g. "$A$1".
+     * @return The parsed reference.
+     */
+    static CFormula::CReference parseReference (const std::string &val);
+
+    /**
+     * @brief Get the value of a literal node.
+     *
+     * @param node The node.
+     * @param value Set to the value if the node is a literal.
+     * @return True if the node is a number or string literal.
+     */
+    static bool literal (const ASTNode *node, CCellValue &value);
+
+    /**
+     * @brief Check whether a node can only evaluate to a number or to an empty value.
+     *
+     * @param node The node.
+     * @return True if the node never evaluates to a string.
+     */
+    static bool isNumeric (const ASTNode *node);
+
+    /**
+     * @brief Make a literal node holding a constant value.
+     *
+     * @param value The value.
+     * @return The node, or nullptr for an empty value and for a number CFormula::printsExactly rejects.
+     */
+    ASTNode *makeLiteral (const CCellValue &value);
+
+    /**
+     * @brief Replace the two topmost nodes by a binary operator, folding it if both operands are literals.
+     *
+     * The folded value is computed by CFormula::apply, exactly as evaluation would compute it.
+     * Operations resulting in an empty value, e.g. division by zero, are kept as they are, and so
+     * are those resulting in a number that would change when the formula is saved and loaded.
+     *
+     * @param op The operation of TNode.
+     */
+    template <typename TNode>
+    void pushOperator (CFormula::EOpCode op)
+    {
+        auto r = m_stack.top();
+        m_stack.pop();
+        auto l = m_stack.top();
+        m_stack.pop();
+        CCellValue left, right;
+        if(literal(l, left) && literal(r, right))
+        {
+            if(auto folded = makeLiteral(CFormula::apply(op, left, right)))
+            {
+                m_stack.push(folded);
+                return;
+            }
+        }
+        m_stack.push(m_nodes->make<TNode>(l, r));
+    }
+
+    CArena *m_nodes;
+    std::stack<ASTNode *> m_stack;
+    bool isExpression;
+};
+
+
+
+CBuilder::CBuilder(CArena *nodes, bool isExp) : m_nodes(nodes), isExpression(isExp) {}
+CBuilder::~CBuilder()
+{
+    m_nodes->clear();
+}
+    void CBuilder::opAdd ()
+    {
+        pushOperator<ASTNodeAdd>(CFormula::OP_ADD);
+    }
+    void CBuilder::opSub ()
+    {
+        pushOperator<ASTNodeSub>(CFormula::OP_SUB);
+    }
+    void CBuilder::opMul ()
+    {
+        pushOperator<ASTNodeMul>(CFormula::OP_MUL);
+    }
+    void CBuilder::opDiv ()
+    {
+        pushOperator<ASTNodeDiv>(CFormula::OP_DIV);
+    }
+    void CBuilder::opPow ()
+    {
+        pushOperator<ASTNodePow>(CFormula::OP_POW);
+    }
+    void CBuilder::opNeg ()
+    {
+        auto l  = m_stack.top();
+        m_stack.pop();
+        if(auto number = dynamic_cast<ASTNodeDouble *>(l))
+        {
+            m_stack.push(m_nodes->make<ASTNodeDouble>(-number->value()));
+            return;
+        }
+        // -(-x) is x only if x cannot be a string, negating a string gives an empty value.
+        if(auto inner = dynamic_cast<ASTNodeNeg *>(l); inner != nullptr && isNumeric(inner->m_left))
+        {
+            m_stack.push(inner->m_left);
+            return;
+        }
+        m_stack.push(m_nodes->make<ASTNodeNeg>(l));
+    }
+    void CBuilder::opEq ()
+    {
+        pushOperator<ASTNodeEq>(CFormula::OP_EQ);
+    }
+    void CBuilder::opNe ()
+    {
+        pushOperator<ASTNodeNe>(CFormula::OP_NE);
+    }
+    void CBuilder::opLt ()
+    {
+        pushOperator<ASTNodeLt>(CFormula::OP_LT);
+    }
+    void CBuilder::opLe ()
+    {
+        pushOperator<ASTNodeLe>(CFormula::OP_LE);
+    }
+    void CBuilder::opGt ()
+    {
+        pushOperator<ASTNodeGt>(CFormula::OP_GT);
+    }
+    void CBuilder::opGe ()
+    {
+        pushOperator<ASTNodeGe>(CFormula::OP_GE);
+    }
+    bool CBuilder::literal (const ASTNode *node, CCellValue &value)
+    {
+        if(auto number = dynamic_cast<const ASTNodeDouble *>(node))
+        {
+            value = number->value();
+            return true;
+        }
+        if(auto text = dynamic_cast<const ASTStringLiteral *>(node))
+        {
+            value = std::make_shared<const std::string>(text->literal());
+            return true;
+        }
+        return false;
+    }
+    bool CBuilder::isNumeric (const ASTNode *node)
+    {
+        if(auto binary = dynamic_cast<const ASTNodeBinaryOperator *>(node))
+            return binary->m_op != CFormula::OP_ADD;
+        return dynamic_cast<const ASTNodeDouble *>(node) != nullptr || dynamic_cast<const ASTNodeUnaryOperator *>(node) != nullptr
+               || dynamic_cast<const ASTNodeRelationalOperator *>(node) != nullptr || dynamic_cast<const ASTNodeFunction *>(node) != nullptr;
+    }
+    ASTNode *CBuilder::makeLiteral (const CCellValue &value)
+    {
+        if(auto number = std::get_if<double>(&value))
+            return CFormula::printsExactly(*number) ? m_nodes->make<ASTNodeDouble>(*number) : nullptr;
+        if(auto text = std::get_if<CString>(&value))
+            return m_nodes->make<ASTStringLiteral>(**text, isExpression);
+        return nullptr;
+    }
+    void CBuilder::valNumber (double val)
+    {
+        m_stack.push(m_nodes->make<ASTNodeDouble>(val));
+    }
+    void CBuilder::valString (std::string val)
+    {
+        m_stack.push(m_nodes->make<ASTStringLiteral>(val, isExpression));
+    }
+    void CBuilder::valReference (std::string val)
+    {
+        auto ref = parseReference(val);
+        m_stack.push(m_nodes->make<ASTNodeReference>(ref.m_pos, ref.m_absoluteColumn, ref.m_absoluteRow));
+    }
+    CFormula::CReference CBuilder::parseReference (const std::string &val)
+    {
+        size_t pos = 0;
+        bool relRow = false, relCol = false;
+        std::string column, row;
+
+        if(val.size() > 0 && val[0] == '$')
+        {
+            pos++;
+            relCol = true;
+        }
+        while(std::isalpha(val[pos]))
+        {
+            column.push_back(val[pos++]);
+        }
+        if(pos < val.size() && val[pos] == '$')
+        {
+            relRow = true;
+            pos++;
+        }
+        row = val.substr(pos);
+        std::string cell(column + row);
+        return {CPos(cell), relCol, relRow};
+    }
+    void CBuilder::valRange (std::string val)
+    {
+        auto split = val.find(':');
+        if(split == std::string::npos)
+            throw std::invalid_argument("Invalid range " + val);
+        auto from = parseReference(val.substr(0, split));
+        auto to = parseReference(val.substr(split + 1));
+        m_stack.push(m_nodes->make<ASTNodeRange>(from, to));
+    }
+    void CBuilder::funcCall (std::string fnName, int paramCount)
+    {
+        auto function = CFormula::findFunction(fnName);
+        if(paramCount <= 0 || m_stack.size() < static_cast<size_t>(paramCount))
+            throw std::invalid_argument("Invalid arguments of " + fnName);
+        std::vector<ASTNode *> arguments(paramCount);
+        for(auto i = paramCount; i > 0; i--)
+        {
+            arguments[i - 1] = m_stack.top();
+            m_stack.pop();
+        }
+        m_stack.push(m_nodes->make<ASTNodeFunction>(function, std::move(arguments)));
+    }
+
+    CFormula CBuilder::getFormula (bool isExp) const
+    {
+        if(m_stack.size() != 1)
+            throw std::invalid_argument("Invalid expression");
+        CFormula formula;
+        formula.isExpression = isExp;
+        ASTNode::compileTree(m_stack.top(), formula);
+        return formula;
+    }
+
+
+/**
+ * @brief The spreadsheet.
+ *
+ * Every public method is safe to call from several threads at once. Reading methods (save,
+ * saveBinary, print, copying the sheet, and getValue, getValues and getNumbers of up to date
+ * cells) take a shared lock and run in parallel with each other. Writing methods take an
+ * exclusive lock, so readers never see a half applied change.
+ *
+ * Evaluation is not parallel across readers: a read that finds an outdated cell takes the
+ * exclusive lock to recalculate it, so after a write the first reads of the affected cells run
+ * one at a time and block all other readers, also those of unrelated cells, until they are done.
+ * Calling recalculate or prefetch right after writing keeps that to one pass. Threads that need
+ * to evaluate independently can each copy the sheet, which is cheap because copies share their
+ * storage until one of them is written to or evaluated, and copies do not lock each other.
+ */
+class CSpreadsheet
+{
+public:
+    static unsigned capabilities ()
+    {
+        return SPREADSHEET_CYCLIC_DEPS;
+    }
+
+    CSpreadsheet () = default;
+    ~CSpreadsheet() = default;
+    CSpreadsheet (const CSpreadsheet &other);
+
+    /**
+     * @brief Replace the sheet with a copy of another one.
+     *
+     * Like a copy, the sheet does not continue its journal or that of the other sheet afterwards,
+     * saveJournal fails until the next checkpoint.
+     *
+     * @param other The sheet to copy.
+     * @return This sheet.
+     */
+    CSpreadsheet & operator = (const CSpreadsheet &other);
+
+    bool load (std::istream &is);
+
+    bool save (std::ostream &os) const;
+
+    /**
+     * @brief Save the sheet in the binary format, which load recognizes by its first byte.
+     *
+     * Formulas are stored compiled, once for all cells sharing them, so loading does not run the
+     * parser. Up to date values are stored as well and are used when loading into an empty sheet.
+     *
+     * @param os Output stream to write to.
+     * @return True on success.
+     */
+    bool saveBinary (std::ostream &os) const;
+
+    /**
+     * @brief Save the whole sheet like save and start a new journal based on it.
+     *
+     * From then on the sheet records which cells change, so saveJournal only has to write those.
+     * Call it whenever needsCheckpoint returns true and replace the old base and journal with it.
+     *
+     * @param os Output stream for the new base.
+     * @return True on success, the journal is not restarted on failure.
+     */
+    bool checkpoint (std::ostream &os);
+
+    /**
+     * @brief Append the cells changed since the last checkpoint or saveJournal to a journal.
+     *
+     * Writes one block in the format of save, holding only the changed cells, in which a cell
+     * that became empty is written with '-' in place of ':' and no contents. The block is
+     * preceded by its length and checksum, 0x1E between and 0x1F after them, so loadJournal finds
+     * where it ends and detects a block cut short or damaged, even when more blocks follow it.
+     * The cost depends on the number of changed cells, not on the size of the sheet.
+     *
+     * @param os Output stream positioned at the end of the journal.
+     * @return False if no journal was started by checkpoint or loadJournal or writing failed,
+     * the changes are kept for the next call then.
+     */
+    bool saveJournal (std::ostream &os);
+
+    /**
+     * @brief Apply the blocks of a journal written by saveJournal, e.g. right after load of its base.
+     *
+     * Each block is applied only once it was read completely and its checksum matched, so a
+     * block whose writing was cut short is not applied, and neither is anything after it. The
+     * stream is then moved back to where that block starts: a journal that is appended to again
+     * has to be cut off there first, e.g. with std::filesystem::resize_file to is.tellg(). The
+     * applied cells are not recorded again, unlike cells loaded by load while journaling, and the
+     * sheet continues the journal afterwards, an empty stream just starts it.
+     *
+     * @param is Input stream holding the journal.
+     * @return False if the journal holds an incomplete or invalid block, the blocks before it
+     * stay applied.
+     */
+    bool loadJournal (std::istream &is);
+
+    /**
+     * @brief Check whether the journal grew large enough that a checkpoint should replace it.
+     *
+     * @return True once the journal holds more records than the last checkpoint held cells.
+     */
+    bool needsCheckpoint () const;
+
+    bool setCell (CPos pos, std::string contents);
+
+    /**
+     * @brief Set the contents of many cells at once.
+     *
+     * The contents are parsed up front, in parallel if setThreadCount started a worker pool, and
+     * stored in order afterwards. Contents that fail to parse are reported like in setCell and
+     * skipped, the other cells are stored. Nothing is evaluated until getValue or recalculate.
+     *
+     * @param cells Positions and contents of the cells, later entries win for repeated positions.
+     * @return True if all contents were valid.
+     */
+    bool setCells (const std::vector<std::pair<CPos, std::string>> &cells);
+
+    CValue getValue (CPos pos);
+
+    /**
+     * @brief Read the values of a rectangle into a buffer, row by row.
+     *
+     * The outdated cells of the whole rectangle are evaluated together in one pass, like
+     * prefetch, instead of once per cell.
+     *
+     * @param from Top left corner of the rectangle.
+     * @param w Width of the rectangle.
+     * @param h Height of the rectangle.
+     * @param values Buffer for at least w * h values, the value of cell (column, row) of the
+     * rectangle goes to values[row * w + column].
+     * @return False if the buffer is too small or the rectangle reaches past the largest column
+     * or row, the buffer is not modified then.
+     */
+    bool getValues (CPos from, int w, int h, std::span<CValue> values);
+
+    /**
+     * @brief Read the numbers of a rectangle into a buffer, row by row, like getValues.
+     *
+     * Cells that are empty, hold a string or lie on a cycle read as quiet NaN. Numbers are read
+     * straight from the cached columns without building a CValue for every cell.
+     *
+     * @param from Top left corner of the rectangle.
+     * @param w Width of the rectangle.
+     * @param h Height of the rectangle.
+     * @param numbers Buffer for at least w * h numbers.
+     * @return False if the buffer is too small or the rectangle reaches past the largest column
+     * or row, the buffer is not modified then.
+     */
+    bool getNumbers (CPos from, int w, int h, std::span<double> numbers);
+
+    /**
+     * @brief Evaluate all outdated cells at once in dependency order.
+     *
+     * Later getValue calls on those cells only read the cached results.
+     */
+    void recalculate();
+
+    /**
+     * @brief Evaluate the outdated cells of a rectangle, e.g. the part of the sheet on screen, at once.
+     *
+     * Nothing is evaluated before it is read, so after load only the requested cells and the
+     * cells they depend on are evaluated, no matter how large the sheet is. The cells of the
+     * rectangle are evaluated together in one pass in dependency order, in parallel if
+     * setThreadCount started a worker pool, and later getValue calls on them only read the results.
+     *
+     * A rectangle reaching past the largest column or row is left alone.
+     *
+     * @param from Top left corner of the rectangle.
+     * @param w Width of the rectangle.
+     * @param h Height of the rectangle.
+     */
+    void prefetch (CPos from, int w, int h);
+
+    /**
+     * @brief Set the number of threads recalculation uses for cells that do not depend on each other.
+     *
+     * Cells in the same topological level of the dependency graph are evaluated concurrently, and
+     * load and setCells parse batches of cells on the same threads.
+     * Evaluation only reads the cached values of precedents, so no locking is needed while the
+     * sheet is not written to. The default of 1 evaluates everything on the calling thread and
+     * stays the default until the pool is shown to scale, benchmark with --threads N first.
+     *
+     * @param threads Number of threads, including the calling one.
+     */
+    void setThreadCount(unsigned threads);
+
+    void copyRect (CPos dst, CPos src, int w = 1, int h = 1);
+
+    /**
+     * @brief Insert empty rows, moving the rows from the given one on down.
+     *
+     * References follow the cells they point to, ranges spanning the insertion grow. Formulas
+     * that only move along with their cells are kept as they are and nothing is evaluated again.
+     *
+     * @param row First inserted row.
+     * @param count Number of inserted rows.
+     * @return False if the arguments are invalid or a cell or reference would move past the
+     * last row, the sheet is not modified then.
+     */
+    bool insertRows (int row, int count);
+
+    /**
+     * @brief Delete rows, moving the rows behind them up.
+     *
+     * Ranges lose their deleted rows. References to deleted cells and ranges of deleted cells
+     * only are replaced by (0/0), so their formulas evaluate to an empty value.
+     *
+     * @param row First deleted row.
+     * @param count Number of deleted rows.
+     * @return False if the arguments are invalid, the sheet is not modified then.
+     */
+    bool deleteRows (int row, int count);
+
+    /**
+     * @brief Insert empty columns like insertRows.
+     *
+     * @param column First inserted column, 1 is column A.
+     * @param count Number of inserted columns.
+     * @return False if the arguments are invalid or a cell or reference would move past the
+     * last column, the sheet is not modified then.
+     */
+    bool insertColumns (int column, int count);
+
+    /**
+     * @brief Delete columns like deleteRows.
+     *
+     * @param column First deleted column, 1 is column A.
+     * @param count Number of deleted columns.
+     * @return False if the arguments are invalid, the sheet is not modified then.
+     */
+    bool deleteColumns (int column, int count);
+
+    void print() const;
+
+#ifdef SPREADSHEET_PROFILE
+    /**
+     * @brief Get what evaluation and parsing did since the sheet was created or resetProfile was called.
+     *
+     * @return The totals.
+     */
+    CProfileStats profile () const;
+
+    /**
+     * @brief Get the cells that took the longest to evaluate since the last resetProfile.
+     *
+     * @param count Largest number of cells to return.
+     * @return The cells, most expensive first.
+     */
+    std::vector<CCellProfile> expensiveCells (size_t count) const;
+
+    /**
+     * @brief Set all counters of the sheet and its cells to zero.
+     */
+    void resetProfile ();
+#endif
+private:
+    /**
+     * @brief Load a sheet written by saveBinary.
+     *
+     * The loaded cells are recorded for the journal, like those load reads in the text format.
+     *
+     * @param is Input stream positioned at the magic bytes.
+     * @return True on success, the sheet is not modified on failure.
+     */
+    bool loadBinary (std::istream &is);
+
+    /**
+     * @brief Write the sheet in the text format.
+     *
+     * @param os Output stream to write to.
+     * @param cells Set to the number of cells written.
+     * @return True on success.
+     */
+    bool saveText (std::ostream &os, size_t &cells) const;
+
+    /**
+     * @brief Remember a cell for the next saveJournal, if a journal was started.
+     *
+     * @param pos Position of the cell.
+     */
+    void recordChange (const CPos &pos);
+
+    /**
+     * @brief Apply one block of a journal.
+     *
+     * @param block The block without its length and checksum.
+     * @return False if the block is invalid, it is not applied then.
+     */
+    bool applyJournalBlock (std::string_view block);
+
+    /**
+     * @brief Compute the checksum saveJournal stores before a block, its 64 bit FNV-1a hash.
+     *
+     * @param block The block.
+     * @return The checksum.
+     */
+    static uint64_t journalChecksum (std::string_view block);
+
+    /**
+     * @brief Build a rectangle from its top left corner and size.
+     *
+     * @param from Top left corner of the rectangle.
+     * @param w Width of the rectangle, at least 1.
+     * @param h Height of the rectangle, at least 1.
+     * @return The rectangle, or nothing if it reaches past the largest column or row.
+     */
+    static std::optional<CRange> rectangle (const CPos &from, int w, int h);
+
+    /**
+     * @brief Make a cell empty and update everything that depends on it.
+     *
+     * @param pos Position of the cell.
+     */
+    void erase (const CPos &pos);
+
+    /**
+     * @brief Parse cell contents into a formula relative to the cell.
+     *
+     * Only touches the given arena, so several threads can parse at once.
+     *
+     * @param pos Position of the cell.
+     * @param contents Contents of the cell.
+     * @param nodes Arena for the syntax tree.
+     * @return The formula.
+     * @throw std::invalid_argument If the contents cannot be parsed.
+     */
+    CFormula parse (const CPos &pos, std::string contents, CArena &nodes) const;
+
+    /**
+     * @brief Find the cells of a range that getValue would have to evaluate.
+     *
+     * @param range The range.
+     * @return Positions of the cells.
+     */
+    std::vector<CPos> findOutdated (const CRange &range) const;
+
+    /**
+     * @brief Evaluate the outdated cells of a range and then read it, like getValue does for one cell.
+     *
+     * Reads under a shared lock if nothing has to be evaluated, otherwise evaluates and reads under
+     * the exclusive one.
+     *
+     * @param range The range.
+     * @param read Function reading the up to date range, called with the lock held.
+     */
+    template <typename F>
+    void readRange (const CRange &range, F &&read);
+
+    /**
+     * @brief Store a parsed formula into a cell and update the dependencies, the caller invalidates it.
+     *
+     * @param pos Position of the cell.
+     * @param formula Formula returned by parse.
+     */
+    void store (const CPos &pos, CFormula formula);
+
+    /**
+     * @brief Recognize contents that are plainly a number or a text without running the parser.
+     *
+     * Only accepts contents the parser is certain to read the same way, everything else is left
+     * to it, e.g. "inf" or contents starting with a space.
+     *
+     * @param contents Contents of a cell.
+     * @param formula Set to the literal if it was recognized.
+     * @return True if the contents were recognized.
+     */
+    static bool parseLiteral (const std::string &contents, CFormula &formula);
+
+    /**
+     * @brief Parse a batch of cells, on the worker pool if there is one, and store them in order.
+     *
+     * The stored cells and their dependents are invalidated in one pass at the end.
+     *
+     * @param batch Positions and contents of the cells.
+     * @param stopAtError True to stop at the first cell that cannot be parsed, false to skip it.
+     * @param record True to record the stored cells for the journal, false only for cells that
+     * come from the journal itself.
+     * @return False if a cell could not be parsed.
+     */
+    bool storeBatch (const std::vector<std::pair<CPos, std::string>> &batch, bool stopAtError, bool record);
+
+    /**
+     * @brief Move the cells behind inserted or deleted rows or columns and rewrite the formulas referencing them.
+     *
+     * Only the moved cells and the cells the dependency index lists as referencing them are
+     * touched and recorded for the journal. Cached values stay valid unless a formula lost a cell
+     * it read, those cells and their dependents are evaluated again.
+     *
+     * @param shift The change.
+     * @return False if the change is invalid or would move a cell or reference past the last
+     * row or column, nothing is modified then.
+     */
+    bool shift (const CShift &shift);
+
+    static constexpr size_t LOAD_BLOCK_SIZE = 1 << 16; ///< Number of bytes loadBinary reads from the stream at once.
+    static constexpr size_t LOAD_BATCH_SIZE = 4096;    ///< Number of cells load parses in parallel at once.
+    static constexpr size_t SAVE_BUFFER_SIZE = 1 << 16; ///< Number of bytes save collects before writing them to the stream.
+    static constexpr char BINARY_MAGIC[] = "\x7FSPS";  ///< First bytes of the binary format.
+    static constexpr uint8_t BINARY_VERSION = 1;       ///< Version of the binary format, stored after the magic bytes.
+    static constexpr uint8_t VALUE_OUTDATED = 0xFF;    ///< Stored instead of the value index of a cell that needs recalculation.
+    static constexpr size_t JOURNAL_MIN_RECORDS = 4096; ///< Number of journal records needsCheckpoint always tolerates.
+    static constexpr size_t JOURNAL_HEADER_SIZE = 40;   ///< Longest length and checksum preceding a journal block.
+
+    CCells m_table;
+    mutable std::shared_mutex m_lock; ///< Shared by readers, exclusive for writers.
+    bool m_journaling = false;         ///< True once checkpoint or loadJournal started a journal, copies and assigned sheets do not continue it.
+    std::set<CPos, CPosComparator> m_changed; ///< Cells changed since the last checkpoint or saveJournal.
+    size_t m_journaled = 0;            ///< Number of records saveJournal wrote since the last checkpoint.
+    size_t m_checkpointCells = 0;      ///< Number of cells the last checkpoint wrote.
+};
+
+
+
+    CSpreadsheet::CSpreadsheet (const CSpreadsheet &other)
+    {
+        std::shared_lock<std::shared_mutex> lock(other.m_lock);
+        m_table.m_cells = other.m_table.m_cells;
+        m_table.m_dependents = other.m_table.m_dependents;
+        m_table.m_precedents = other.m_table.m_precedents;
+        m_table.m_precedentRanges = other.m_table.m_precedentRanges;
+        m_table.m_rangeDependents = other.m_table.m_rangeDependents;
+        m_table.m_numbers = other.m_table.m_numbers;
+    }
+    CSpreadsheet& CSpreadsheet::operator = (const CSpreadsheet &other)
+    {
+        if(this != &other)
+        {
+            std::unique_lock<std::shared_mutex> mine(m_lock, std::defer_lock);
+            std::shared_lock<std::shared_mutex> theirs(other.m_lock, std::defer_lock);
+            std::lock(mine, theirs);
+            m_table.m_cells = other.m_table.m_cells;
+            m_table.m_dependents = other.m_table.m_dependents;
+            m_table.m_precedents = other.m_table.m_precedents;
+            m_table.m_precedentRanges = other.m_table.m_precedentRanges;
+            m_table.m_rangeDependents = other.m_table.m_rangeDependents;
+            m_table.m_numbers = other.m_table.m_numbers;
+            // The journal only knows the cells changed one by one, the base it continues is gone.
+            m_journaling = false;
+            m_changed.clear();
+            m_journaled = 0;
+            m_checkpointCells = 0;
+        }
+        return  *this;
+    }
+    bool CSpreadsheet::load (std::istream &is)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        if (!is)
+        {
+            return false;
+        }
+        if (is.peek() == BINARY_MAGIC[0])
+        {
+            return loadBinary(is);
+        }
+
+        char ch;
+        if (!(is >> ch) || ch != '{')
+        {
+            return false;
+        }
+
+        if (!(is >> ch) || ch != static_cast<char>(31))
+        {
+            return false;
+        }
+
+        // Entries are read up to their separator by getline, which copies them out of the stream
+        // buffer in bulk, and nothing past the closing } is taken from the stream.
+        std::vector<std::pair<CPos, std::string>> batch;
+        std::string entry;
+        while (true)
+        {
+            auto next = is.peek();
+            if(next == std::char_traits<char>::eof())
+                return false;
+            if(next == '}')
+            {
+                is.get();
+                break;
+            }
+            if(!std::getline(is, entry, static_cast<char>(31)) || is.eof())
+                return false;
+
+            auto posEnd = entry.find(static_cast<char>(30));
+            if(posEnd == std::string::npos || entry.size() < posEnd + 3
+               || entry[posEnd + 1] != ':' || entry[posEnd + 2] != static_cast<char>(30))
+                return false;
+            CPos pos;
+            try
+            {
+                pos = CPos(entry.substr(0, posEnd));
+            }
+            catch (const std::invalid_argument &)
+            {
+                storeBatch(batch, true, true);
+                return false;
+            }
+            batch.emplace_back(pos, entry.substr(posEnd + 3));
+            if(batch.size() == LOAD_BATCH_SIZE)
+            {
+                if(!storeBatch(batch, true, true))
+                    return false;
+                batch.clear();
+            }
+        }
+        return storeBatch(batch, true, true);
+    }
+    bool CSpreadsheet::storeBatch (const std::vector<std::pair<CPos, std::string>> &batch, bool stopAtError, bool record)
+    {
+        std::vector<CFormula> formulas(batch.size());
+        std::vector<std::string> errors(batch.size());
+        std::vector<char> failed(batch.size(), false);
+        auto parseRange = [this, &batch, &formulas, &errors, &failed](size_t begin, size_t end)
+        {
+            CArena nodes;
+            for(size_t i = begin; i < end; i++)
+            {
+                try
+                {
+                    formulas[i] = parse(batch[i].first, batch[i].second, nodes);
+                }
+                catch (const std::invalid_argument &e)
+                {
+                    errors[i] = e.what();
+                    failed[i] = true;
+                }
+            }
+        };
+        if(m_table.m_pool != nullptr)
+            m_table.m_pool->parallelFor(batch.size(), parseRange);
         else
-            os << m_literal;
+            parseRange(0, batch.size());
+        bool valid = true;
+        std::vector<CPos> stored;
+        stored.reserve(batch.size());
+        for(size_t i = 0; i < batch.size(); i++)
+        {
+            if(failed[i])
+            {
+                std::cout << errors[i];
+                valid = false;
+                if(stopAtError)
+                    break;
+                continue;
+            }
+            store(batch[i].first, std::move(formulas[i]));
+            stored.push_back(batch[i].first);
+        }
+        m_table.invalidate(stored);
+        if(record)
+        {
+            for(const auto &pos : stored)
+                recordChange(pos);
+        }
+        return valid;
+    }
+    bool CSpreadsheet::save (std::ostream &os) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        size_t cells;
+        return saveText(os, cells);
+    }
+    bool CSpreadsheet::saveText (std::ostream &os, size_t &cells) const
+    {
+        cells = 0;
+        if (!os)
+        {
+            return false;
+        }
+        // Everything is formatted into one buffer, which is written out whenever it grows past
+        // SAVE_BUFFER_SIZE.
+        std::string out;
+        out.reserve(2 * SAVE_BUFFER_SIZE);
+        out += '{';
+        out += static_cast<char>(31);
+
+        m_table.m_cells.forEachOrdered([&os, &out, &cells](const CPos &pos, const CCell &cell)
+        {
+            if (!os || cell.m_formula->empty())
+            {
+                return;
+            }
+            cells++;
+            pos.appendTo(out);
+            out += static_cast<char>(30);
+            out += ':';
+            out += static_cast<char>(30);
+            cell.m_formula->print(out, pos);
+            out += static_cast<char>(31);
+            if (out.size() >= SAVE_BUFFER_SIZE)
+            {
+                os.write(out.data(), static_cast<std::streamsize>(out.size()));
+                out.clear();
+            }
+        });
+
+        out += '}';
+        if(!os.write(out.data(), static_cast<std::streamsize>(out.size())))
+            return false;
+        return true;
+    }
+    bool CSpreadsheet::checkpoint (std::ostream &os)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        size_t cells;
+        if(!saveText(os, cells))
+            return false;
+        m_journaling = true;
+        m_changed.clear();
+        m_journaled = 0;
+        m_checkpointCells = cells;
+        return true;
+    }
+    bool CSpreadsheet::saveJournal (std::ostream &os)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        if (!m_journaling || !os)
+        {
+            return false;
+        }
+        std::string out;
+        out += '{';
+        out += static_cast<char>(31);
+        for(const auto &pos : m_changed)
+        {
+            pos.appendTo(out);
+            out += static_cast<char>(30);
+            auto found = m_table.m_cells.find(pos);
+            if(found == nullptr || found->m_formula->empty())
+                out += '-';
+            else
+            {
+                out += ':';
+                out += static_cast<char>(30);
+                found->m_formula->print(out, pos);
+                out += static_cast<char>(31);
+                continue;
+            }
+            out += static_cast<char>(30);
+            out += static_cast<char>(31);
+        }
+        out += '}';
+        char header[JOURNAL_HEADER_SIZE];
+        auto length = std::snprintf(header, sizeof(header), "%zu\x1e%016llx\x1f", out.size(),
+                                    static_cast<unsigned long long>(journalChecksum(out)));
+        out.insert(0, header, static_cast<size_t>(length));
+        // The block goes out in one write, so a crash can only leave it unfinished at the end.
+        if(!os.write(out.data(), static_cast<std::streamsize>(out.size())) || !os.flush())
+            return false;
+        m_journaled += m_changed.size();
+        m_changed.clear();
+        return true;
+    }
+    bool CSpreadsheet::loadJournal (std::istream &is)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        if (!is)
+        {
+            return false;
+        }
+        m_journaling = true;
+        std::string header, block;
+        while(true)
+        {
+            auto start = is.tellg();
+            auto fail = [&is, &start]()
+            {
+                is.clear();
+                if(start != std::istream::pos_type(-1))
+                    is.seekg(start);
+                return false;
+            };
+            if(is.peek() == std::char_traits<char>::eof())
+                return true;
+
+            // Length and checksum, the header is short, so a damaged one is not read to the end of the stream.
+            header.clear();
+            char ch;
+            while(header.size() < JOURNAL_HEADER_SIZE && is.get(ch) && ch != static_cast<char>(31))
+                header += ch;
+            if(!is || ch != static_cast<char>(31))
+                return fail();
+            auto separator = header.find(static_cast<char>(30));
+            size_t length = 0;
+            uint64_t checksum = 0;
+            if(separator == std::string::npos
+               || std::from_chars(header.data(), header.data() + separator, length).ptr != header.data() + separator
+               || std::from_chars(header.data() + separator + 1, header.data() + header.size(), checksum, 16).ptr != header.data() + header.size())
+                return fail();
+
+            // The block is read in pieces, so a damaged length cannot allocate more than the stream holds.
+            block.clear();
+            while(block.size() < length)
+            {
+                auto size = block.size();
+                auto piece = std::min(length - size, LOAD_BLOCK_SIZE);
+                block.resize(size + piece);
+                is.read(block.data() + size, static_cast<std::streamsize>(piece));
+                if(static_cast<size_t>(is.gcount()) != piece)
+                    return fail();
+            }
+            if(journalChecksum(block) != checksum || !applyJournalBlock(block))
+                return fail();
+        }
+    }
+    bool CSpreadsheet::applyJournalBlock (std::string_view block)
+    {
+        if(block.size() < 3 || block[0] != '{' || block[1] != static_cast<char>(31) || block.back() != '}')
+            return false;
+        auto rest = block.substr(2, block.size() - 3);
+
+        // The whole block is read before anything is applied.
+        std::vector<std::pair<CPos, std::optional<std::string_view>>> records;
+        while(!rest.empty())
+        {
+            auto separator = rest.find(static_cast<char>(31));
+            if(separator == std::string_view::npos)
+                return false;
+            auto entry = rest.substr(0, separator);
+            rest.remove_prefix(separator + 1);
+            auto posEnd = entry.find(static_cast<char>(30));
+            if(posEnd == std::string::npos || entry.size() < posEnd + 3
+               || (entry[posEnd + 1] != ':' && entry[posEnd + 1] != '-') || entry[posEnd + 2] != static_cast<char>(30))
+                return false;
+            bool removed = entry[posEnd + 1] == '-';
+            if(removed && entry.size() != posEnd + 3)
+                return false;
+            CPos pos;
+            try
+            {
+                pos = CPos(entry.substr(0, posEnd));
+            }
+            catch (const std::invalid_argument &)
+            {
+                return false;
+            }
+            records.emplace_back(pos, removed ? std::nullopt : std::optional(entry.substr(posEnd + 3)));
+        }
+
+        std::vector<std::pair<CPos, std::string>> batch;
+        for(const auto &[pos, contents] : records)
+        {
+            if(contents)
+            {
+                batch.emplace_back(pos, *contents);
+                continue;
+            }
+            if(!storeBatch(batch, true, false))
+                return false;
+            batch.clear();
+            erase(pos);
+        }
+        return storeBatch(batch, true, false);
+    }
+    std::optional<CRange> CSpreadsheet::rectangle (const CPos &from, int w, int h)
+    {
+        constexpr long long last = std::numeric_limits<int32_t>::max();
+        if(from.getColumn() + w - 1 > last || from.getRow() + h - 1 > last)
+            return std::nullopt;
+        return CRange(from, from + std::make_pair(w - 1, h - 1));
+    }
+    uint64_t CSpreadsheet::journalChecksum (std::string_view block)
+    {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for(auto ch : block)
+        {
+            hash ^= static_cast<unsigned char>(ch);
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+    bool CSpreadsheet::needsCheckpoint () const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        return m_journaled + m_changed.size() > std::max(JOURNAL_MIN_RECORDS, m_checkpointCells);
+    }
+    void CSpreadsheet::recordChange (const CPos &pos)
+    {
+        if(m_journaling)
+            m_changed.insert(pos);
     }
-    bool ASTStringLiteral::hasCycle(std::map<CPos, bool, CPosComparator> &visited) const
+    void CSpreadsheet::erase (const CPos &pos)
     {
-        return false;
+        m_table.m_cells.erase(pos);
+        m_table.storeNumber(pos, CCellValue {});
+        m_table.updateDependencies(pos);
+        m_table.invalidate(pos);
     }
+    bool CSpreadsheet::saveBinary (std::ostream &os) const
+    {
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        if (!os)
+        {
+            return false;
+        }
+        CBinaryWriter formulas, cells;
+        std::unordered_map<const CFormula *, uint32_t> indices;
+        uint32_t cellCount = 0;
+        m_table.m_cells.forEach([&formulas, &cells, &indices, &cellCount](const CPos &pos, const CCell &cell)
+        {
+            if (cell.m_formula->empty())
+            {
+                return;
+            }
+            auto [index, inserted] = indices.emplace(cell.m_formula.get(), static_cast<uint32_t>(indices.size()));
+            if (inserted)
+            {
+                cell.m_formula->write(formulas);
+            }
+            cells.writeI32(static_cast<int32_t>(pos.getColumn()));
+            cells.writeI32(static_cast<int32_t>(pos.getRow()));
+            cells.writeU32(index->second);
+            // A cyclic cell is saved as outdated, its empty value alone would load as not cyclic.
+            if (cell.m_dirty || cell.m_cyclic)
+            {
+                cells.writeByte(VALUE_OUTDATED);
+            }
+            else
+            {
+                cells.writeByte(static_cast<uint8_t>(cell.m_value.index()));
+                if (auto number = std::get_if<double>(&cell.m_value))
+                    cells.writeDouble(*number);
+                else if (auto text = std::get_if<CString>(&cell.m_value))
+                    cells.writeString(**text);
+            }
+            cellCount++;
+        });
 
-ASTNodeDouble::ASTNodeDouble(double value) : ASTNode(nullptr, nullptr), m_value(value){}
-
-CValue ASTNodeDouble::evaluate()
-{
-    return m_value;
-}
-std::shared_ptr<ASTNode> ASTNodeDouble::deepCopy (std::map<CPos,std::shared_ptr<ASTNode>, CPosComparator> &map) const
-{
-    auto copy = std::make_shared<ASTNodeDouble>(m_value);
-    return copy;
-}
-void ASTNodeDouble::moveRelativelyBy(const std::pair<long long int, long long int> &offset){}
-
-void ASTNodeDouble::print(std::ostream &os) const
-{
-    os << std::to_string(m_value);
-}
-bool ASTNodeDouble::hasCycle(std::map<CPos, bool, CPosComparator> &visited) const
-{
-    return false;
-}
+        CBinaryWriter header;
+        for (auto ch : std::string_view(BINARY_MAGIC))
+        {
+            header.writeByte(static_cast<uint8_t>(ch));
+        }
+        header.writeByte(BINARY_VERSION);
+        header.writeU32(static_cast<uint32_t>(indices.size()));
+        os.write(header.data().data(), static_cast<std::streamsize>(header.data().size()));
+        os.write(formulas.data().data(), static_cast<std::streamsize>(formulas.data().size()));
+        CBinaryWriter count;
+        count.writeU32(cellCount);
+        os.write(count.data().data(), static_cast<std::streamsize>(count.data().size()));
+        os.write(cells.data().data(), static_cast<std::streamsize>(cells.data().size()));
+        return static_cast<bool>(os);
+    }
+    bool CSpreadsheet::loadBinary (std::istream &is)
+    {
+        std::vector<char> buffer;
+        while (is)
+        {
+            auto size = buffer.size();
+            buffer.resize(size + LOAD_BLOCK_SIZE);
+            is.read(buffer.data() + size, LOAD_BLOCK_SIZE);
+            buffer.resize(size + static_cast<size_t>(is.gcount()));
+        }
 
+        struct CLoadedCell
+        {
+            CPos m_pos;
+            uint32_t m_formula;
+            bool m_outdated;
+            CCellValue m_value;
+        };
+        std::vector<std::shared_ptr<const CFormula>> formulas;
+        std::vector<CLoadedCell> cells;
+        try
+        {
+            CBinaryReader in(buffer.data(), buffer.data() + buffer.size());
+            for (auto ch : std::string_view(BINARY_MAGIC))
+            {
+                if (in.readByte() != static_cast<uint8_t>(ch))
+                    return false;
+            }
+            if (in.readByte() != BINARY_VERSION)
+            {
+                return false;
+            }
+            auto formulaCount = in.readU32();
+            for (uint32_t i = 0; i < formulaCount; i++)
+            {
+                formulas.push_back(m_table.intern(CFormula::read(in)));
+            }
+            auto cellCount = in.readU32();
+            for (uint32_t i = 0; i < cellCount; i++)
+            {
+                auto column = in.readI32();
+                auto row = in.readI32();
+                CLoadedCell cell {CPos(column, row), in.readU32(), false, CCellValue {}};
+                if (column < 0 || row < 0 || cell.m_formula >= formulas.size())
+                    return false;
+                switch (in.readByte())
+                {
+                    case 0:
+                        break;
+                    case 1:
+                        cell.m_value = in.readDouble();
+                        break;
+                    case 2:
+                        cell.m_value = std::make_shared<const std::string>(in.readString());
+                        break;
+                    case VALUE_OUTDATED:
+                        cell.m_outdated = true;
+                        break;
+                    default:
+                        return false;
+                }
+                cells.push_back(std::move(cell));
+            }
+            if (!in.atEnd())
+            {
+                return false;
+            }
+        }
+        catch (const std::invalid_argument &)
+        {
+            return false;
+        }
 
-ASTNodeRoot::ASTNodeRoot(bool isExp) : ASTNode(nullptr, nullptr, isExp) {}
-    CValue ASTNodeRoot::evaluate()
+        // The stored values are consistent among themselves, but cells already in the sheet may
+        // depend on the loaded ones, so they are only trusted when the sheet starts out empty.
+        bool useValues = m_table.m_cells.empty();
+        for (const auto &loaded : cells)
+        {
+            auto &cell = m_table.m_cells[loaded.m_pos];
+            cell = CCell();
+            cell.m_formula = formulas[loaded.m_formula];
+            if (useValues && !loaded.m_outdated)
+            {
+                cell.m_value = loaded.m_value;
+                cell.m_dirty = false;
+            }
+            m_table.storeNumber(loaded.m_pos, cell.m_value);
+        }
+        for (const auto &loaded : cells)
+        {
+            m_table.updateDependencies(loaded.m_pos);
+            if (!useValues || loaded.m_outdated)
+                m_table.invalidate(loaded.m_pos);
+            recordChange(loaded.m_pos);
+        }
+        return true;
+    }
+    bool CSpreadsheet::parseLiteral (const std::string &contents, CFormula &formula)
     {
-        if(m_left)
-            return m_left->evaluate();
+        if(contents.empty())
+            return false;
+        auto first = static_cast<unsigned char>(contents[0]);
+        if(std::isalpha(first) && std::toupper(first) != 'I' && std::toupper(first) != 'N')
+        {
+            formula.emitString(contents);
+            return true;
+        }
 
-        return CValue {};
+        // [-]digits[.digits][(e|E)[+|-]digits] with at least one digit in the mantissa.
+        size_t i = contents[0] == '-' ? 1 : 0, digits = 0;
+        auto skipDigits = [&contents, &i]()
+        {
+            size_t start = i;
+            while(i < contents.size() && std::isdigit(static_cast<unsigned char>(contents[i])))
+                i++;
+            return i - start;
+        };
+        digits += skipDigits();
+        if(i < contents.size() && contents[i] == '.')
+        {
+            i++;
+            digits += skipDigits();
+        }
+        if(digits == 0)
+            return false;
+        if(i < contents.size() && (contents[i] == 'e' || contents[i] == 'E'))
+        {
+            i++;
+            if(i < contents.size() && (contents[i] == '+' || contents[i] == '-'))
+                i++;
+            if(skipDigits() == 0)
+                return false;
+        }
+        if(i != contents.size())
+            return false;
+        formula.emitNumber(std::strtod(contents.c_str(), nullptr));
+        return true;
     }
-    std::shared_ptr<ASTNode> ASTNodeRoot::deepCopy(std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+    CFormula CSpreadsheet::parse (const CPos &pos, std::string contents, CArena &nodes) const
     {
-        auto copy = std::make_shared<ASTNodeRoot>(isExpression);
-        if(m_left)
-            copy->m_left = m_left->deepCopy(map);
-        return copy;
+        PROFILE_COUNT(m_table.m_profile.m_parsed, 1);
+        CFormula literal;
+        if(parseLiteral(contents, literal))
+            return literal;
+
+        bool isExp = false;
+        if(contents[0] == '=')
+            isExp = true;
+        PROFILE_ONLY(auto start = std::chrono::steady_clock::now();)
+        PROFILE_ONLY(auto made = nodes.made();)
+        CBuilder builder(&nodes, isExp);
+        parseExpression(std::move(contents), builder);
+        PROFILE_COUNT(m_table.m_profile.m_nodeAllocations, nodes.made() - made);
+        PROFILE_COUNT(m_table.m_profile.m_parseNanoseconds, nanosecondsSince(start));
+        auto formula = builder.getFormula(isExp);
+        formula.toRelative(pos);
+        return formula;
     }
-    void ASTNodeRoot::moveRelativelyBy(const std::pair<long long int, long long int> &offset)
+    void CSpreadsheet::store (const CPos &pos, CFormula formula)
     {
-        if(m_left)
-            m_left->moveRelativelyBy(offset);
+        // Values typed into cells rarely repeat, so they are not worth looking up.
+        if(formula.isExpression)
+            m_table.m_cells[pos].m_formula = m_table.intern(std::move(formula));
+        else
+            m_table.m_cells[pos].m_formula = std::make_shared<const CFormula>(std::move(formula));
+        m_table.updateDependencies(pos);
     }
-
-    void ASTNodeRoot::print(std::ostream &os) const
+    bool CSpreadsheet::setCells (const std::vector<std::pair<CPos, std::string>> &cells)
     {
-        if(isExpression)
-            os << "=";
-        if(m_left)
-            m_left->print(os);
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        return storeBatch(cells, false, true);
     }
-
-    bool ASTNodeRoot::hasCycle(std::map<CPos, bool, CPosComparator> &visited) const
+    bool CSpreadsheet::setCell (CPos pos, std::string contents)
     {
-        bool detected = false;
-        if(m_left)
-            detected = m_left->hasCycle(visited);
-        return detected;
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        try
+        {
+            store(pos, parse(pos, std::move(contents), m_table.m_nodes));
+            m_table.invalidate(pos);
+            recordChange(pos);
+        }
+        catch (const std::invalid_argument &e)
+        {
+            std::cout << e.what();
+            return false;
+        }
+        return true;
     }
-
-ASTNodeReference::ASTNodeReference(std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> *table, CPos cell, bool relCol, bool relRow) :
-            ASTNode(nullptr, nullptr),
-            m_table(table),
-            m_pos(cell),
-            isColumnRelative(relCol),
-            isRowRelative(relRow) {}
-
-
-    CValue ASTNodeReference::evaluate()
+    CValue CSpreadsheet::getValue (CPos pos)
     {
-        if(auto cell = m_table->find(m_pos); cell != m_table->end())
         {
-            if(cell->second != nullptr)
+            std::shared_lock<std::shared_mutex> lock(m_lock);
+            auto cell = m_table.m_cells.find(pos);
+            if(cell == nullptr)
+            {
+                return CValue{};
+            }
+            if(!cell->m_dirty)
             {
-                return cell->second->evaluate();
+                return cell->m_cyclic ? CValue {} : toValue(cell->m_value);
             }
         }
-        return CValue {};
-    }
 
-    std::shared_ptr<ASTNode> ASTNodeReference::deepCopy(std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> &map) const
+        // Another writer may have run between the locks, so start over.
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        auto cell = m_table.m_cells.find(pos);
+        if(cell == nullptr)
+        {
+            return CValue{};
+        }
+        if(cell->m_dirty)
+        {
+            // Recalculation may unshare the tile of the cell, so look it up again.
+            m_table.recalculate({pos});
+            cell = m_table.m_cells.find(pos);
+        }
+        if(cell->m_cyclic)
+            return CValue {};
+
+        return toValue(cell->m_value);
+    }
+    void CSpreadsheet::recalculate()
+    {
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        m_table.recalculate();
+    }
+    std::vector<CPos> CSpreadsheet::findOutdated (const CRange &range) const
+    {
+        std::vector<CPos> outdated;
+        m_table.m_cells.forEachIn(range, [&outdated](const CPos &pos, const CCell &cell)
+        {
+            if(cell.m_dirty)
+                outdated.push_back(pos);
+        });
+        return outdated;
+    }
+    template <typename F>
+    void CSpreadsheet::readRange (const CRange &range, F &&read)
     {
-        if(map[m_pos] == nullptr)
         {
-            map[m_pos] = std::make_shared<ASTNodeRoot>();
+            std::shared_lock<std::shared_mutex> lock(m_lock);
+            if(findOutdated(range).empty())
+            {
+                read();
+                return;
+            }
         }
-        auto copy = std::make_shared<ASTNodeReference>(&map, m_pos, isColumnRelative, isRowRelative);
-        return copy;
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        m_table.recalculate(findOutdated(range));
+        read();
     }
-    void ASTNodeReference::moveRelativelyBy(const std::pair<long long int, long long int> &offset)
+    void CSpreadsheet::prefetch (CPos from, int w, int h)
     {
-        auto offs = offset;
-        if(isColumnRelative)
-            offs.first = 0;
-        if(isRowRelative)
-            offs.second = 0;
-        m_pos = m_pos + offs;
+        if(w <= 0 || h <= 0)
+            return;
+        auto range = rectangle(from, w, h);
+        if(!range)
+            return;
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        m_table.recalculate(findOutdated(*range));
     }
-
-    void ASTNodeReference::print(std::ostream &os) const
+    bool CSpreadsheet::getValues (CPos from, int w, int h, std::span<CValue> values)
     {
-        if(isColumnRelative)
-            os <<"$";
-        os << m_pos.getColumnStr();
-        if(isRowRelative)
-            os << "$";
-        os << m_pos.getRow();
+        if(w <= 0 || h <= 0)
+            return true;
+        auto range = rectangle(from, w, h);
+        if(!range || values.size() / static_cast<size_t>(w) < static_cast<size_t>(h))
+            return false;
+        readRange(*range, [this, &range, &from, w, h, &values]()
+        {
+            std::fill_n(values.begin(), static_cast<size_t>(w) * static_cast<size_t>(h), CValue {});
+            m_table.m_cells.forEachIn(*range, [&from, w, &values](const CPos &pos, const CCell &cell)
+            {
+                if(!cell.m_cyclic)
+                    values[static_cast<size_t>(pos.getRow() - from.getRow()) * static_cast<size_t>(w)
+                           + static_cast<size_t>(pos.getColumn() - from.getColumn())] = toValue(cell.m_value);
+            });
+        });
+        return true;
     }
-    bool ASTNodeReference::hasCycle(std::map<CPos, bool, CPosComparator> &visited) const
+    bool CSpreadsheet::getNumbers (CPos from, int w, int h, std::span<double> numbers)
     {
-        if(visited.find(m_pos) != visited.end() && visited[m_pos])
+        if(w <= 0 || h <= 0)
             return true;
-        visited[m_pos] = true;
-        bool detected = false;
-        if(auto cell = m_table->find(m_pos); cell != m_table->end())
+        auto range = rectangle(from, w, h);
+        if(!range || numbers.size() / static_cast<size_t>(w) < static_cast<size_t>(h))
+            return false;
+        readRange(*range, [this, &from, w, h, &numbers]()
         {
-            if(cell->second != nullptr)
+            std::fill_n(numbers.begin(), static_cast<size_t>(w) * static_cast<size_t>(h), std::numeric_limits<double>::quiet_NaN());
+            for(int column = 0; column < w; column++)
             {
-                detected = cell->second->hasCycle(visited);
+                for(int row = 0; row < h; )
+                {
+                    // Copy the rows of the rectangle that fall into the same chunk at once.
+                    CPos pos(from.getColumn() + column, from.getRow() + row);
+                    auto slot = static_cast<int>(pos.getRow() & (CNumberChunk::CHUNK_SIZE - 1));
+                    int count = std::min(h - row, CNumberChunk::CHUNK_SIZE - slot);
+                    if(auto chunk = m_table.m_numbers.find(CCells::numberChunk(pos)))
+                    {
+                        for(int i = 0; i < count; i++)
+                        {
+                            if(chunk->m_isNumber[slot + i])
+                                numbers[static_cast<size_t>(row + i) * static_cast<size_t>(w) + static_cast<size_t>(column)] = chunk->m_numbers[slot + i];
+                        }
+                    }
+                    row += count;
+                }
             }
+        });
+        return true;
+    }
+    void CSpreadsheet::setThreadCount(unsigned threads)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        m_table.setThreadCount(threads);
+    }
+    void CSpreadsheet::copyRect (CPos dst, CPos src, int w, int h)
+    {
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        if(w <= 0 || h <= 0)
+            return;
+        // A rectangle reaching past the largest column or row is not copied, not even in part.
+        auto sourceRange = rectangle(src, w, h), targetRange = rectangle(dst, w, h);
+        if(!sourceRange || !targetRange)
+            return;
+        auto offset = std::make_pair(dst.getColumn() - src.getColumn(), dst.getRow() - src.getRow());
+        const auto &source = *sourceRange, &target = *targetRange;
+
+        // Take the source cells first, so an overlapping destination does not read cells it has
+        // already overwritten. Formulas are relative to their cells, the copies share them unchanged.
+        std::vector<std::pair<CPos, std::shared_ptr<const CFormula>>> copied;
+        m_table.m_cells.forEachIn(source, [&copied, &offset](const CPos &pos, const CCell &cell)
+        {
+            if(!cell.m_formula->empty())
+                copied.emplace_back(pos + offset, cell.m_formula);
+        });
+        std::sort(copied.begin(), copied.end(), [](const auto &a, const auto &b)
+        {
+            return CPosComparator()(a.first, b.first);
+        });
+
+        // Destination cells without a source cell become empty.
+        std::vector<CPos> cleared;
+        m_table.m_cells.forEachIn(target, [&copied, &cleared](const CPos &pos, const CCell &)
+        {
+            auto found = std::lower_bound(copied.begin(), copied.end(), pos, [](const auto &entry, const CPos &key)
+            {
+                return CPosComparator()(entry.first, key);
+            });
+            if(found == copied.end() || !(found->first == pos))
+                cleared.push_back(pos);
+        });
+
+        for(const auto &pos : cleared)
+        {
+            recordChange(pos);
+            erase(pos);
         }
-        if(!detected)
+        for(auto &[pos, formula] : copied)
         {
-            visited[m_pos] = false;
+            recordChange(pos);
+            m_table.m_cells[pos].m_formula = std::move(formula);
+            m_table.updateDependencies(pos);
+            m_table.invalidate(pos);
         }
-
-        return detected;
     }
-
-
-struct CCells
-{
-    std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> m_cells;
-};
-
-
-class CBuilder : public CExprBuilder
-{
-public:
-    CBuilder(CCells *cells, bool isExp = false);
-    void opAdd () override;
-    void opSub () override;
-    void opMul () override;
-    void opDiv () override;
-    void opPow () override;
-    void opNeg () override;
-    void opEq () override;
-    void opNe () override;
-    void opLt () override;
-    void opLe () override;
-    void opGt () override;
-    void opGe () override;
-    void valNumber (double val) override;
-    void valString (std::string val) override;
-    void valReference (std::string val) override;
-    void valRange (std::string val) override;
-    void funcCall (std::string fnName, int paramCount) override;
-    void getRoot (std::shared_ptr<ASTNode> &root, bool isExp) const;
-private:
-    CCells *m_table;
-    std::stack<std::shared_ptr<ASTNode>> m_stack;
-    bool isExpression;
-};
-
-
-
-CBuilder::CBuilder(CCells *cells, bool isExp) : m_table(cells), isExpression(isExp) {}
-void CBuilder::opAdd ()
+#ifdef SPREADSHEET_PROFILE
+    CProfileStats CSpreadsheet::profile () const
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeAdd>(l, r));
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        return m_table.m_profile.stats();
     }
-    void CBuilder::opSub ()
+    std::vector<CCellProfile> CSpreadsheet::expensiveCells (size_t count) const
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeSub>(l, r));
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        std::vector<CCellProfile> cells;
+        m_table.m_cells.forEach([&cells](const CPos &pos, const CCell &cell)
+        {
+            if(cell.m_evaluations != 0)
+                cells.push_back({pos, cell.m_evaluations, cell.m_evaluationNanoseconds});
+        });
+        auto costlier = [](const CCellProfile &a, const CCellProfile &b)
+        {
+            if(a.m_evaluationNanoseconds != b.m_evaluationNanoseconds)
+                return a.m_evaluationNanoseconds > b.m_evaluationNanoseconds;
+            return CPosComparator()(a.m_pos, b.m_pos);
+        };
+        count = std::min(count, cells.size());
+        std::partial_sort(cells.begin(), cells.begin() + static_cast<std::ptrdiff_t>(count), cells.end(), costlier);
+        cells.resize(count);
+        return cells;
     }
-    void CBuilder::opMul ()
+    void CSpreadsheet::resetProfile ()
     {
-        auto l  = m_stack.top();
-        m_stack.pop();
-        auto r = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeMul>(l, r));
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        std::vector<CPos> evaluated;
+        m_table.m_cells.forEach([&evaluated](const CPos &pos, const CCell &cell)
+        {
+            if(cell.m_evaluations != 0)
+                evaluated.push_back(pos);
+        });
+        for(const auto &pos : evaluated)
+        {
+            auto cell = m_table.m_cells.modify(pos);
+            cell->m_evaluations = 0;
+            cell->m_evaluationNanoseconds = 0;
+        }
+        auto &profile = m_table.m_profile;
+        for(auto counter : {&profile.m_evaluations, &profile.m_evaluationNanoseconds, &profile.m_cycleSteps, &profile.m_referenceLookups,
+                            &profile.m_nodeAllocations, &profile.m_parsed, &profile.m_parseNanoseconds})
+            counter->store(0, std::memory_order_relaxed);
     }
-    void CBuilder::opDiv ()
-    {   //check zero divide
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeDiv>(l, r));
+#endif
+    bool CSpreadsheet::shift (const CShift &shift)
+    {
+        if(shift.m_at < 0 || shift.m_count == 0)
+            return false;
+
+        // Only the cells from m_at on move. Cells before them are rewritten if their formulas
+        // reference the moved cells, the dependency index tells which ones do.
+        auto area = shift.area();
+        std::vector<std::pair<CPos, CCell>> moved;
+        std::set<CPos, CPosComparator> referrers;
+        long long last = -1;
+        m_table.m_cells.forEachIn(area, [&moved, &last, &shift](const CPos &pos, const CCell &cell)
+        {
+            moved.emplace_back(pos, cell);
+            last = std::max(last, shift.coordinate(pos));
+        });
+        m_table.m_dependents.forEachIn(area, [&referrers, &last, &shift](const CPos &pos, const std::set<CPos, CPosComparator> &dependents)
+        {
+            referrers.insert(dependents.begin(), dependents.end());
+            last = std::max(last, shift.coordinate(pos));
+        });
+        m_table.m_rangeDependents.forEachOverlapping(area, [&referrers, &last, &shift](const CRange &range, const CPos &dependent)
+        {
+            referrers.insert(dependent);
+            last = std::max(last, shift.coordinate(range.m_to));
+        });
+        if(last + shift.m_count > std::numeric_limits<int32_t>::max())
+            return false;
+
+        // Everything is taken out before anything is put back, a cell may move to where another one was.
+        for(const auto &[pos, cell] : moved)
+        {
+            referrers.erase(pos);
+            m_table.m_cells.erase(pos);
+            m_table.storeNumber(pos, CCellValue {});
+            m_table.updateDependencies(pos);
+            recordChange(pos);
+        }
+        std::vector<CPos> placed, invalid;
+        for(auto &[pos, cell] : moved)
+        {
+            auto target = shift.map(pos);
+            if(!target)
+                continue;
+            if(cell.m_formula->readsDeleted(shift, pos))
+                invalid.push_back(*target);
+            CFormula rewritten;
+            if(cell.m_formula->shifted(shift, pos, *target, rewritten))
+                cell.m_formula = m_table.intern(std::move(rewritten));
+            m_table.storeNumber(*target, cell.m_value);
+            m_table.m_cells[*target] = std::move(cell);
+            placed.push_back(*target);
+            recordChange(*target);
+        }
+        for(const auto &pos : placed)
+            m_table.updateDependencies(pos);
+        for(const auto &pos : referrers)
+        {
+            auto cell = m_table.m_cells.find(pos);
+            CFormula rewritten;
+            if(cell == nullptr || !cell->m_formula->shifted(shift, pos, pos, rewritten))
+                continue;
+            if(cell->m_formula->readsDeleted(shift, pos))
+                invalid.push_back(pos);
+            m_table.m_cells.modify(pos)->m_formula = m_table.intern(std::move(rewritten));
+            m_table.updateDependencies(pos);
+            recordChange(pos);
+        }
+        m_table.invalidate(invalid);
+        return true;
     }
-    void CBuilder::opPow ()
+    bool CSpreadsheet::insertRows (int row, int count)
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodePow>(l, r));
+        if(count <= 0)
+            return false;
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        return shift({false, row, count});
     }
-    void CBuilder::opNeg ()
+    bool CSpreadsheet::deleteRows (int row, int count)
     {
-        auto l  = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeNeg>(l));
+        if(count <= 0)
+            return false;
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        return shift({false, row, -static_cast<long long>(count)});
     }
-    void CBuilder::opEq ()
+    bool CSpreadsheet::insertColumns (int column, int count)
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeEq>(l, r));
+        if(count <= 0)
+            return false;
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        return shift({true, column, count});
     }
-    void CBuilder::opNe ()
+    bool CSpreadsheet::deleteColumns (int column, int count)
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeNe>(l, r));
+        if(count <= 0)
+            return false;
+        std::unique_lock<std::shared_mutex> lock(m_lock);
+        return shift({true, column, -static_cast<long long>(count)});
     }
-    void CBuilder::opLt ()
+    void CSpreadsheet::print() const
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeLt>(l, r));
+        std::shared_lock<std::shared_mutex> lock(m_lock);
+        m_table.m_cells.forEachOrdered([](const CPos &pos, const CCell &cell)
+        {
+            if(!cell.m_formula->empty())
+            {
+                std::cout << pos.getColumnStr() << pos.getRow() << ":";
+                cell.m_formula->print(std::cout, pos);
+                std::cout << std::endl;
+            }
+        });
+    }
+
+
+#if defined(SPREADSHEET_BENCHMARK) && defined(SPREADSHEET_TESTS)
+#error "SPREADSHEET_BENCHMARK and SPREADSHEET_TESTS both add a main, define only one of them"
+#endif
+
+#ifdef SPREADSHEET_BENCHMARK
+#include <numeric>
+#include <sys/resource.h>
+
+/**
+ * @brief Synthetic sheets and timing for the benchmark build.
+ *
+ * Building with SPREADSHEET_BENCHMARK defined adds a main that runs every benchmark on every
+ * generated sheet and prints one line per result, or one JSON object per line with --json.
+ */
+namespace benchmark
+{
+    using CSheet = std::vector<std::pair<CPos, std::string>>;
+
+    /**
+     * @brief Column A holds a number followed by cells that each add one to the cell above.
+     *
+     * @param length Number of cells.
+     * @return Contents of the cells.
+     */
+    CSheet chain (int length)
+    {
+        CSheet sheet { {CPos(1, 1), "1"} };
+        for(int row = 2; row <= length; row++)
+            sheet.emplace_back(CPos(1, row), "=A" + std::to_string(row - 1) + "+1");
+        return sheet;
+    }
+
+    /**
+     * @brief A1 holds a number and every cell of column B scales it.
+     *
+     * @param width Number of cells reading A1.
+     * @return Contents of the cells.
+     */
+    CSheet fanOut (int width)
+    {
+        CSheet sheet { {CPos(1, 1), "2"} };
+        for(int row = 1; row <= width; row++)
+            sheet.emplace_back(CPos(2, row), "=$A$1*" + std::to_string(row));
+        return sheet;
     }
-    void CBuilder::opLe ()
+
+    /**
+     * @brief Column A holds numbers, every other column combines its left neighbour with column A of the same row.
+     *
+     * @param rows Number of rows.
+     * @param columns Number of columns, including column A.
+     * @return Contents of the cells.
+     */
+    CSheet fillDown (int rows, int columns)
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeLe>(l, r));
+        CSheet sheet;
+        for(int row = 1; row <= rows; row++)
+        {
+            sheet.emplace_back(CPos(1, row), std::to_string(row));
+            for(int column = 2; column <= columns; column++)
+            {
+                std::string formula = "=";
+                CPos(column - 1, row).appendTo(formula);
+                formula += "*2+$A";
+                formula += std::to_string(row);
+                sheet.emplace_back(CPos(column, row), std::move(formula));
+            }
+        }
+        return sheet;
     }
-    void CBuilder::opGt ()
+
+    /**
+     * @brief Every cell holds a string of varying length, some of them with quotes and separators.
+     *
+     * @param rows Number of rows.
+     * @param columns Number of columns.
+     * @return Contents of the cells.
+     */
+    CSheet text (int rows, int columns)
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeGt>(l, r));
+        CSheet sheet;
+        for(int row = 1; row <= rows; row++)
+            for(int column = 1; column <= columns; column++)
+            {
+                std::string value = "Row " + std::to_string(row) + " says \"hello\"";
+                value.append(static_cast<size_t>((row * 7 + column * 13) % 40), 'x');
+                sheet.emplace_back(CPos(column, row), std::move(value));
+            }
+        return sheet;
     }
-    void CBuilder::opGe ()
+
+    /**
+     * @brief Every cell holds a long formula of references and constants, so parsing dominates loading.
+     *
+     * The formulas read the rows below the sheet, which stay empty, so evaluation is cheap as well.
+     *
+     * @param rows Number of rows.
+     * @param columns Number of columns.
+     * @return Contents of the cells.
+     */
+    CSheet expressions (int rows, int columns)
     {
-        auto r  = m_stack.top();
-        m_stack.pop();
-        auto l = m_stack.top();
-        m_stack.pop();
-        m_stack.push(std::make_shared<ASTNodeGe>(l, r));
+        CSheet sheet;
+        for(int row = 1; row <= rows; row++)
+            for(int column = 1; column <= columns; column++)
+            {
+                auto below = std::to_string(rows + row);
+                sheet.emplace_back(CPos(column, row), "=(A" + below + "+2)*(B" + below + "-3)/(C" + below + "+4)^2-(D"
+                                                      + below + "*5+6)*(7-A" + std::to_string(rows + row + 1) + ")");
+            }
+        return sheet;
     }
-    void CBuilder::valNumber (double val)
+
+    /**
+     * @brief Timing of one benchmark.
+     */
+    struct CResult
+    {
+        std::string m_name;            ///< Name of the measured operation.
+        std::string m_sheet;           ///< Name of the sheet it ran on.
+        size_t m_items = 0;            ///< Number of cells the operations processed in total, 0 if they do not process cells.
+        std::vector<double> m_latency; ///< Duration of every operation in seconds.
+    };
+
+    /**
+     * @brief Time an operation.
+     *
+     * @param name Name of the operation.
+     * @param sheet Name of the sheet.
+     * @param ops Number of times to run the operation.
+     * @param items Number of cells one run processes, 0 for operations whose cost does not follow a number of cells.
+     * @param op The operation, gets the number of the run.
+     * @return Durations of the runs.
+     */
+    template <typename TOp>
+    CResult measure (std::string name, std::string sheet, size_t ops, size_t items, TOp &&op)
     {
-        m_stack.push(std::make_shared<ASTNodeDouble>(val));
+        CResult result { std::move(name), std::move(sheet), ops * items, {} };
+        result.m_latency.reserve(ops);
+        for(size_t i = 0; i < ops; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            op(i);
+            result.m_latency.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        return result;
     }
-    void CBuilder::valString (std::string val)
+
+    /**
+     * @brief Print a result with its throughput, latency percentiles and the peak memory of the process so far.
+     *
+     * @param result The result.
+     * @param json Print a JSON object instead of aligned text.
+     */
+    void report (CResult result, bool json)
     {
-        m_stack.push(std::make_shared<ASTStringLiteral>(val, isExpression));
+        auto &latency = result.m_latency;
+        std::sort(latency.begin(), latency.end());
+        double total = std::accumulate(latency.begin(), latency.end(), 0.0);
+        auto percentile = [&latency](double p)
+        {
+            return latency.empty() ? 0.0 : latency[std::min(latency.size() - 1, static_cast<size_t>(p * static_cast<double>(latency.size())))] * 1e6;
+        };
+        rusage usage {};
+        getrusage(RUSAGE_SELF, &usage);
+
+        // Operations that do not process cells report no cell throughput.
+        char throughput[32] = "-";
+        if(result.m_items != 0)
+            snprintf(throughput, sizeof(throughput), "%.1f", static_cast<double>(result.m_items) / total);
+        else if(json)
+            snprintf(throughput, sizeof(throughput), "null");
+
+        char line[512];
+        if(json)
+            snprintf(line, sizeof(line), "{\"benchmark\":\"%s\",\"sheet\":\"%s\",\"ops\":%zu,\"items\":%zu,\"seconds\":%.6f,"
+                     "\"ops_per_sec\":%.1f,\"items_per_sec\":%s,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,"
+                     "\"max_us\":%.3f,\"peak_rss_kb\":%ld}",
+                     result.m_name.c_str(), result.m_sheet.c_str(), latency.size(), result.m_items, total,
+                     static_cast<double>(latency.size()) / total, throughput,
+                     percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0), usage.ru_maxrss);
+        else
+            snprintf(line, sizeof(line), "%-10s %-10s %8zu ops %12.1f ops/s %12s cells/s  p50 %10.3f us  p90 %10.3f us  p99 %10.3f us  max %10.3f us  peak %8ld kB",
+                     result.m_name.c_str(), result.m_sheet.c_str(), latency.size(),
+                     static_cast<double>(latency.size()) / total, throughput,
+                     percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0), usage.ru_maxrss);
+        std::cout << line << std::endl;
     }
-    void CBuilder::valReference (std::string val)
+
+    /**
+     * @brief Run every benchmark that works on a whole sheet.
+     *
+     * @param name Name of the sheet.
+     * @param cells Contents of the sheet.
+     * @param json Print JSON objects.
+     * @param threads Number of threads passed to setThreadCount.
+     */
+    void run (const std::string &name, const CSheet &cells, bool json, unsigned threads)
     {
-        size_t pos = 0;
-        bool relRow = false, relCol = false;
-        std::string column, row;
+        CSpreadsheet sheet;
+        sheet.setThreadCount(threads);
+        report(measure("setCell", name, cells.size(), 1, [&](size_t i)
+        {
+            sheet.setCell(cells[i].first, cells[i].second);
+        }), json);
+        // The first read recalculates the whole sheet, it shows up as the maximum latency.
+        report(measure("getValue", name, cells.size(), 1, [&](size_t i)
+        {
+            sheet.getValue(cells[i].first);
+        }), json);
 
-        if(val.size() > 0 && val[0] == '$')
+        std::string saved;
+        report(measure("save", name, 5, cells.size(), [&](size_t)
         {
-            pos++;
-            relCol = true;
-        }
-        while(std::isalpha(val[pos]))
+            std::ostringstream os;
+            sheet.save(os);
+            saved = os.str();
+        }), json);
+        report(measure("load", name, 5, cells.size(), [&](size_t)
         {
-            column.push_back(val[pos++]);
-        }
-        if(pos < val.size() && val[pos] == '$')
+            std::istringstream is(saved);
+            CSpreadsheet loaded;
+            loaded.setThreadCount(threads);
+            loaded.load(is);
+        }), json);
+        // Copies share their storage, so copying takes the same time for any sheet. The first
+        // write to a copy unshares what it touches and is timed on its own. The copies are only
+        // destroyed after the measurements.
+        std::vector<CSpreadsheet> copies;
+        copies.reserve(100);
+        report(measure("copy", name, 100, 0, [&](size_t)
         {
-            relRow = true;
-            pos++;
-        }
-        row = val.substr(pos);
-        std::string cell(column + row);
-        if(m_table->m_cells[CPos(cell)] == nullptr)
+            copies.emplace_back(sheet);
+        }), json);
+        report(measure("copyWrite", name, copies.size(), 0, [&](size_t i)
         {
-            m_table->m_cells[CPos(cell)] = std::make_shared<ASTNodeRoot>();
-        }
-        auto ref = std::make_shared<ASTNodeReference>(&m_table->m_cells, CPos(cell), relCol, relRow);
-        m_stack.push(ref);
+            copies[i].setCell(cells.front().first, cells.front().second);
+        }), json);
     }
-    void CBuilder::valRange (std::string val){}
-    void CBuilder::funcCall (std::string fnName, int paramCount){}
+}
 
-    void CBuilder::getRoot (std::shared_ptr<ASTNode> &root, bool isExp) const
+/**
+ * @brief Run the benchmarks.
+ *
+ * Options: --json prints one JSON object per result, --scale N multiplies the size of every sheet,
+ * --threads N runs every sheet with N threads to measure how parallel loading and recalculation scale.
+ */
+int main (int argc, char *argv[])
+{
+    bool json = false;
+    int scale = 1;
+    unsigned threads = 1;
+    for(int i = 1; i < argc; i++)
     {
-        if(root == nullptr)
+        if(std::string(argv[i]) == "--json")
+            json = true;
+        else if(std::string(argv[i]) == "--scale" && i + 1 < argc)
+            scale = std::max(1, std::atoi(argv[++i]));
+        else if(std::string(argv[i]) == "--threads" && i + 1 < argc)
+            threads = static_cast<unsigned>(std::max(1, std::atoi(argv[++i])));
+        else
         {
-            root = std::make_shared<ASTNodeRoot>(isExp);
+            std::cerr << "Usage: " << argv[0] << " [--json] [--scale N] [--threads N]" << std::endl;
+            return 1;
         }
-        root->m_left = m_stack.top();
     }
 
-
-class CSpreadsheet
-{
-public:
-    static unsigned capabilities ()
+    benchmark::run("chain", benchmark::chain(100000 * scale), json, threads);
+    benchmark::run("fan-out", benchmark::fanOut(100000 * scale), json, threads);
+    benchmark::run("fill-down", benchmark::fillDown(10000 * scale, 10), json, threads);
+    benchmark::run("text", benchmark::text(20000 * scale, 5), json, threads);
+    benchmark::run("formulas", benchmark::expressions(20000 * scale, 4), json, threads);
+
+    // Copy a fill-down block next to itself, every copy lands one block further right.
+    const int rows = 10000 * scale;
+    const int columns = 10;
+    CSpreadsheet sheet;
+    sheet.setThreadCount(threads);
+    sheet.setCells(benchmark::fillDown(rows, columns));
+    benchmark::report(benchmark::measure("copyRect", "fill-down", 10, static_cast<size_t>(rows) * columns, [&](size_t i)
     {
-        return SPREADSHEET_CYCLIC_DEPS;
-    }
-
-    CSpreadsheet () = default;
-    ~CSpreadsheet() = default;
-    CSpreadsheet (const CSpreadsheet &other);
-
-    CSpreadsheet & operator = (const CSpreadsheet &other);
-
-    bool load (std::istream &is);
-
-    bool save (std::ostream &os) const;
-
-    bool setCell (CPos pos, std::string contents);
+        sheet.copyRect(CPos(static_cast<long long>((i + 1) * columns + 1), 1), CPos(1, 1), columns, rows);
+    }), json);
+    benchmark::report(benchmark::measure("recalc", "fill-down", 1, static_cast<size_t>(rows) * columns * 11, [&](size_t)
+    {
+        sheet.recalculate();
+    }), json);
+    return 0;
+}
+#endif
 
-    CValue getValue (CPos pos);
 
-    void copyRect (CPos dst, CPos src, int w = 1, int h = 1);
+#ifdef SPREADSHEET_TESTS
+#define SPREADSHEET_CHECK(expression) tests::check((expression), #expression, __LINE__)
 
-    void print() const;
-private:
-    CCells m_table;
-};
+/**
+ * @brief Behavior checks for the test build.
+ *
+ * Building with SPREADSHEET_TESTS defined (and without SPREADSHEET_BENCHMARK) adds a main that
+ * runs every check, prints the line of every failed one and exits with 1 if any failed.
+ */
+namespace tests
+{
+    int failures = 0; ///< Number of failed checks so far.
 
+    /**
+     * @brief Count and print a failed check.
+     *
+     * @param passed Result of the check.
+     * @param expression Text of the check.
+     * @param line Line of the check.
+     */
+    void check (bool passed, const char *expression, int line)
+    {
+        if(passed)
+            return;
+        failures++;
+        std::cerr << "main.cpp:" << line << ": check failed: " << expression << std::endl;
+    }
 
+    /**
+     * @brief Compare a value with the expected one, numbers need to be equal up to rounding.
+     *
+     * @param value The value.
+     * @param expected The expected value.
+     * @return true if they match.
+     */
+    bool equals (const CValue &value, const CValue &expected)
+    {
+        if(value.index() != expected.index())
+            return false;
+        if(!std::holds_alternative<double>(value))
+            return value == expected;
+        auto a = std::get<double>(value);
+        auto b = std::get<double>(expected);
+        return a == b || std::fabs(a - b) <= 1e-9 * std::max(std::fabs(a), std::fabs(b));
+    }
 
-    CSpreadsheet::CSpreadsheet (const CSpreadsheet &other)
+    /**
+     * @brief Positions and rectangles near the largest row do not wrap around.
+     */
+    void positions ()
     {
-        for(const auto &cell : other.m_table.m_cells)
+        constexpr long long last = std::numeric_limits<int32_t>::max();
+        auto throws = [](auto &&make)
         {
-            if(m_table.m_cells[cell.first] != nullptr)
+            try
             {
-                if(cell.second->m_left)
-                    m_table.m_cells[cell.first]->m_left = cell.second->m_left->deepCopy(m_table.m_cells);
+                make();
             }
-            else
+            catch (const std::invalid_argument &)
             {
-                m_table.m_cells[cell.first] = cell.second->deepCopy(m_table.m_cells);
+                return true;
             }
-        }
+            return false;
+        };
+        SPREADSHEET_CHECK(throws([]() { return CPos(1, last + 1); }));
+        SPREADSHEET_CHECK(throws([]() { return CPos(last + 1, 1); }));
+        SPREADSHEET_CHECK(throws([]() { return CPos(1, last) + std::make_pair(0, 1); }));
+        SPREADSHEET_CHECK((CPos(1, last - 1) + std::make_pair(0, 1)) == CPos(1, last));
+
+        CSpreadsheet sheet;
+        for(int row = 1; row <= 10; row++)
+            sheet.setCell(CPos(1, row), std::to_string(row));
+        sheet.setCell(CPos("B1"), "=A1+1");
+        std::ostringstream before;
+        SPREADSHEET_CHECK(sheet.save(before));
+
+        // Rectangles reaching past the last row are refused as a whole.
+        sheet.copyRect(CPos(1, last - 7), CPos("A1"), 1, 10);
+        sheet.copyRect(CPos("A1"), CPos(1, last - 7), 1, 10);
+        sheet.prefetch(CPos(1, last - 7), 1, 10);
+        std::ostringstream after;
+        SPREADSHEET_CHECK(sheet.save(after));
+        SPREADSHEET_CHECK(before.str() == after.str());
+
+        // Up to the last row they are copied, together with the formulas.
+        sheet.copyRect(CPos(1, last - 9), CPos("A1"), 2, 10);
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos(1, last)), CValue(10.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos(2, last - 9)), CValue(2.0)));
+        sheet.copyRect(CPos(2, last), CPos("B1"));
+        sheet.prefetch(CPos(1, last - 9), 2, 10);
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos(2, last)), CValue(11.0)));
     }
-    CSpreadsheet& CSpreadsheet::operator = (const CSpreadsheet &other)
+
+    /**
+     * @brief Range functions over numbers, strings and empty cells, on short and on long ranges.
+     */
+    void rangeFunctions ()
     {
-        if(this != &other)
-        {
-            m_table.m_cells.clear();
-            for(const auto &cell : other.m_table.m_cells)
-            {
-                if(m_table.m_cells[cell.first] != nullptr)
-                {
-                    if(cell.second->m_left)
-                        m_table.m_cells[cell.first]->m_left = cell.second->m_left->deepCopy(m_table.m_cells);
-                }
-                else
-                {
-                    m_table.m_cells[cell.first] = cell.second->deepCopy(m_table.m_cells);
-                }
-            }
-        }
-        return  *this;
+        CSpreadsheet sheet;
+        sheet.setCell(CPos("A1"), "1");
+        sheet.setCell(CPos("A2"), "text");
+        sheet.setCell(CPos("A3"), "=2*2");
+        sheet.setCell(CPos("B1"), "-3");
+        sheet.setCell(CPos("C1"), "=SUM(A1:B4)");
+        sheet.setCell(CPos("C2"), "=AVERAGE(A1:B4)");
+        sheet.setCell(CPos("C3"), "=MIN(A1:B4)");
+        sheet.setCell(CPos("C4"), "=MAX(A1:B4)");
+        sheet.setCell(CPos("C5"), "=COUNT(A1:B4)");
+        sheet.setCell(CPos("C6"), "=SUM(A2:A2)");
+        sheet.setCell(CPos("C7"), "=COUNT(D1:D9)");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue(2.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C2")), CValue(2.0 / 3)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C3")), CValue(-3.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C4")), CValue(4.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C5")), CValue(3.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C6")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C7")), CValue(0.0)));
+        sheet.setCell(CPos("B4"), "10");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue(12.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C4")), CValue(10.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C5")), CValue(4.0)));
+
+        // Long ranges of different shapes, an edit anywhere inside has to reach the cells using them.
+        CSpreadsheet large;
+        large.setCell(CPos("B1"), "=SUM(A1:A100000)");
+        large.setCell(CPos("B2"), "=COUNT(A5:ZZ1000000)");
+        large.setCell(CPos("B3"), "=MAX(C5:ZZZ5)");
+        large.setCell(CPos("B4"), "=SUM(A50000:A100000)");
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B1")), CValue()));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B2")), CValue(0.0)));
+        large.setCell(CPos("A100000"), "5");
+        large.setCell(CPos("A1"), "2");
+        large.setCell(CPos("ABC5"), "7");
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B1")), CValue(7.0)));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B2")), CValue(1.0)));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B3")), CValue(7.0)));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B4")), CValue(5.0)));
+        large.setCell(CPos("A100001"), "100");
+        large.setCell(CPos("ZZZ6"), "100");
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B1")), CValue(7.0)));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B3")), CValue(7.0)));
+
+        // Replacing the formulas removes their ranges from the index, later edits must not reach them.
+        large.setCell(CPos("B1"), "1");
+        large.setCell(CPos("B4"), "=SUM(A99999:A100000)");
+        large.setCell(CPos("A50000"), "1");
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B1")), CValue(1.0)));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B4")), CValue(5.0)));
+        large.setCell(CPos("A99999"), "1");
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B4")), CValue(6.0)));
+
+        // A copy shares the index until it is changed.
+        CSpreadsheet copy(large);
+        copy.setCell(CPos("A99999"), "3");
+        SPREADSHEET_CHECK(equals(copy.getValue(CPos("B4")), CValue(8.0)));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("B4")), CValue(6.0)));
     }
-    bool CSpreadsheet::load (std::istream &is)
+
+    /**
+     * @brief Saving and loading the text format, also with other data following the sheet in the stream.
+     */
+    void textFormat ()
     {
-        if (!is)
+        CSpreadsheet sheet;
+        sheet.setCell(CPos("A1"), "10");
+        sheet.setCell(CPos("A2"), "=A1*2");
+        sheet.setCell(CPos("B1"), "text with } and { in it");
+        CSpreadsheet other;
+        other.setCell(CPos("C3"), "=1+2");
+
+        std::ostringstream out;
+        SPREADSHEET_CHECK(sheet.save(out));
+        SPREADSHEET_CHECK(other.save(out));
+        out << "rest";
+        std::istringstream in(out.str());
+        CSpreadsheet first, second;
+        SPREADSHEET_CHECK(first.load(in));
+        SPREADSHEET_CHECK(equals(first.getValue(CPos("A2")), CValue(20.0)));
+        SPREADSHEET_CHECK(equals(first.getValue(CPos("B1")), CValue("text with } and { in it")));
+        SPREADSHEET_CHECK(equals(first.getValue(CPos("C3")), CValue()));
+        SPREADSHEET_CHECK(second.load(in));
+        SPREADSHEET_CHECK(equals(second.getValue(CPos("C3")), CValue(3.0)));
+        std::string rest;
+        SPREADSHEET_CHECK(std::getline(in, rest) && rest == "rest");
+
+        // Input cut short anywhere fails to load.
+        std::ostringstream saved;
+        sheet.save(saved);
+        for(size_t length = 0; length < saved.str().size(); length++)
         {
-            return false;
+            std::istringstream cut(saved.str().substr(0, length));
+            CSpreadsheet loaded;
+            SPREADSHEET_CHECK(!loaded.load(cut));
         }
+    }
 
-        char ch;
-        std::string pos, expression;
-
-        if (!(is >> ch) || ch != '{')
-        {
-            return false;
-        }
+    /**
+     * @brief Save the sheet in the text format.
+     *
+     * @param sheet The sheet.
+     * @return The saved text.
+     */
+    std::string saved (const CSpreadsheet &sheet)
+    {
+        std::ostringstream out;
+        sheet.save(out);
+        return out.str();
+    }
 
-        if (!(is >> ch) || ch != static_cast<char>(31))
+    /**
+     * @brief Saving and loading the binary format, with stored values, and rejecting broken input.
+     */
+    void binaryFormat ()
+    {
+        CSpreadsheet sheet;
+        sheet.setCell(CPos("A1"), "1.5");
+        sheet.setCell(CPos("A2"), "=$A$1*2+A$1-SUM(A1:A1)");
+        sheet.setCell(CPos("A3"), "=\"text\"");
+        sheet.setCell(CPos("A4"), "plain text");
+        sheet.setCell(CPos("A5"), "=A6");
+        sheet.setCell(CPos("A6"), "=A5");
+        sheet.setCell(CPos("B1"), "=A1+1");
+        sheet.setCell(CPos("B2"), "=A1+1");
+        sheet.setCell(CPos("C1"), "=COUNT(A1:B4)+MAX(A1:A2)");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A2")), CValue(3.0)));
+        sheet.setCell(CPos("A1"), "2"); // leaves the dependents outdated in the saved data
+
+        std::ostringstream out;
+        SPREADSHEET_CHECK(sheet.saveBinary(out));
+        auto binary = out.str();
+
+        CSpreadsheet loaded;
+        std::istringstream in(binary);
+        SPREADSHEET_CHECK(loaded.load(in));
+        SPREADSHEET_CHECK(saved(loaded) == saved(sheet));
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("A2")), CValue(4.0)));
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("A3")), CValue("text")));
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("A4")), CValue("plain text")));
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("A5")), CValue()));
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("B2")), CValue(3.0)));
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("C1")), CValue(8.0)));
+        loaded.setCell(CPos("A1"), "10");
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("B1")), CValue(11.0)));
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("C1")), CValue(24.0)));
+        loaded.setCell(CPos("A6"), "7");
+        SPREADSHEET_CHECK(equals(loaded.getValue(CPos("A5")), CValue(7.0)));
+
+        // Loading into a sheet with cells evaluates again, the stored values may be stale there.
+        CSpreadsheet merged;
+        merged.setCell(CPos("A1"), "100");
+        merged.setCell(CPos("D1"), "=B1");
+        SPREADSHEET_CHECK(equals(merged.getValue(CPos("D1")), CValue()));
+        std::istringstream again(binary);
+        SPREADSHEET_CHECK(merged.load(again));
+        SPREADSHEET_CHECK(equals(merged.getValue(CPos("A2")), CValue(4.0)));
+        SPREADSHEET_CHECK(equals(merged.getValue(CPos("D1")), CValue(3.0)));
+
+        // Cut or damaged input fails or loads some sheet, and a failed load leaves the sheet as it was.
+        CSpreadsheet target;
+        target.setCell(CPos("Z1"), "=1+1");
+        auto before = saved(target);
+        for(size_t length = 0; length < binary.size(); length++)
         {
-            return false;
+            std::istringstream cut(binary.substr(0, length));
+            SPREADSHEET_CHECK(!target.load(cut));
+            SPREADSHEET_CHECK(saved(target) == before);
         }
-        while (true)
+        for(size_t i = 0; i < binary.size(); i++)
         {
-            while(is.get(ch) && ch != static_cast<char>(30))
-                pos.push_back(ch);
-            if(!is)
-                return false;
-            if(!(is >> ch) && ch != ':')
-                return false;
-            if(!(is >> ch) && ch != static_cast<char>(30))
-                return false;
-            while(is.get(ch) && ch != static_cast<char>(31))
-                expression.push_back(ch);
-            if(!is)
-                return false;
-            if(!setCell(CPos(pos), expression))
-                return false;
-            pos.clear();
-            expression.clear();
-            if(is.peek() == '}')
-                break;
+            auto damaged = binary;
+            damaged[i] = static_cast<char>(damaged[i] ^ 0x5A);
+            std::istringstream bad(damaged);
+            CSpreadsheet result;
+            if(result.load(bad))
+                result.recalculate();
+            else
+                SPREADSHEET_CHECK(saved(result).size() == 3);
         }
-        return true;
     }
-    bool CSpreadsheet::save (std::ostream &os) const
+
+    /**
+     * @brief Compare two values exactly, NaN matches NaN.
+     *
+     * @param value The value.
+     * @param expected The expected value.
+     * @return true if they are the same.
+     */
+    bool same (const CValue &value, const CValue &expected)
     {
-        if (!os)
+        if(auto a = std::get_if<double>(&value), b = std::get_if<double>(&expected); a != nullptr && b != nullptr)
+            return *a == *b || (std::isnan(*a) && std::isnan(*b));
+        return value == expected;
+    }
+
+    /**
+     * @brief Constant folding gives the values evaluation would give, also after saving and loading.
+     */
+    void constantFolding ()
+    {
+        const char *formulas[] = {"=9/3.5", "=3^0.5", "=8/6", "=8.5^7", "=(-8)^0.5", "=10^400", "=-(10^400)",
+                                  "=((-8)^0.5>=1)+1", "=1+2*3", "=-2.5-0.25", "=1/0", "=1/0+2", "=\"a\"+\"b\"",
+                                  "=\"a\"+1", "=-\"a\"", "=(1<2)+(\"a\"=\"a\")", "=2^-0.5"};
+        CSpreadsheet sheet;
+        int row = 1;
+        for(auto formula : formulas)
+            sheet.setCell(CPos(1, row++), formula);
+        auto text = saved(sheet);
+        std::istringstream in(text);
+        CSpreadsheet loaded;
+        SPREADSHEET_CHECK(loaded.load(in));
+        SPREADSHEET_CHECK(saved(loaded) == text);
+        for(int i = 1; i < row; i++)
+            SPREADSHEET_CHECK(same(loaded.getValue(CPos(1, i)), sheet.getValue(CPos(1, i))));
+
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A1")), CValue(9 / 3.5)));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A2")), CValue(std::pow(3, 0.5))));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A4")), CValue(std::pow(8.5, 7))));
+        SPREADSHEET_CHECK(std::isnan(std::get<double>(sheet.getValue(CPos("A5")))));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A6")), CValue(HUGE_VAL)));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A7")), CValue(-HUGE_VAL)));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A9")), CValue(7.0)));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A10")), CValue(-2.75)));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A11")), CValue()));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A12")), CValue()));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A13")), CValue("ab")));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A15")), CValue()));
+        SPREADSHEET_CHECK(same(sheet.getValue(CPos("A16")), CValue(2.0)));
+
+        // Constants that print exactly are folded into a single number.
+        SPREADSHEET_CHECK(text.find("7.000000") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("(-2.750000)") != std::string::npos);
+    }
+
+    /**
+     * @brief setCells stores the valid cells of a batch, skips the others and invalidates what depends on them.
+     */
+    void batchWrites ()
+    {
+        CSpreadsheet sheet;
+        sheet.setCell(CPos("B2"), "old");
+        sheet.setCell(CPos("C1"), "=A1+A3");
+        sheet.setCell(CPos("C2"), "=SUM(A1:A3)");
+        sheet.setCell(CPos("C3"), "=C1*C2");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C3")), CValue()));
+        std::ostringstream base;
+        SPREADSHEET_CHECK(sheet.checkpoint(base));
+
+        SPREADSHEET_CHECK(!sheet.setCells({ {CPos("A1"), "1"}, {CPos("B2"), "=1+"}, {CPos("A3"), "=A1*2"},
+                                            {CPos("B3"), "=(("}, {CPos("A1"), "2"} }));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A1")), CValue(2.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A3")), CValue(4.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B2")), CValue("old")));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B3")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue(6.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C2")), CValue(6.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C3")), CValue(36.0)));
+        SPREADSHEET_CHECK(sheet.setCells({ {CPos("A1"), "-1"} }));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C3")), CValue(-3.0 * -3.0)));
+
+        // Only the stored cells are journaled.
+        std::ostringstream journal;
+        SPREADSHEET_CHECK(sheet.saveJournal(journal));
+        SPREADSHEET_CHECK(journal.str().find("A3") != std::string::npos);
+        SPREADSHEET_CHECK(journal.str().find("B2") == std::string::npos);
+        SPREADSHEET_CHECK(journal.str().find("B3") == std::string::npos);
+    }
+
+    /**
+     * @brief Cells on and behind a cycle read as empty until a precedent changes, also after saving and loading.
+     */
+    void cycles ()
+    {
+        CSpreadsheet sheet;
+        sheet.setCell(CPos("A1"), "=A2+1");
+        sheet.setCell(CPos("A2"), "=A1+1");
+        sheet.setCell(CPos("B1"), "=A1*2");
+        sheet.setCell(CPos("B2"), "=COUNT(A1:A2)");
+        sheet.setCell(CPos("B3"), "=COUNT(C1:C2)");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A1")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B1")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B2")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B3")), CValue(0.0)));
+#ifdef SPREADSHEET_PROFILE
+        // Once found, the cycle is not searched again by reads.
+        auto before = sheet.profile();
+        for(int i = 0; i < 10; i++)
+            SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B1")), CValue()));
+        SPREADSHEET_CHECK(sheet.profile().m_cycleSteps == before.m_cycleSteps);
+        SPREADSHEET_CHECK(sheet.profile().m_evaluations == before.m_evaluations);
+#endif
+
+        // A cell reading the cycle later is behind it as well.
+        sheet.setCell(CPos("C1"), "=B1");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B3")), CValue()));
+
+        // The cyclic cells survive saving in both formats.
+        for(bool binary : {false, true})
         {
-            return false;
+            std::ostringstream out;
+            SPREADSHEET_CHECK(binary ? sheet.saveBinary(out) : sheet.save(out));
+            std::istringstream in(out.str());
+            CSpreadsheet loaded;
+            SPREADSHEET_CHECK(loaded.load(in));
+            SPREADSHEET_CHECK(equals(loaded.getValue(CPos("B2")), CValue()));
+            loaded.setCell(CPos("D1"), "=COUNT(A1:A2)");
+            SPREADSHEET_CHECK(equals(loaded.getValue(CPos("D1")), CValue()));
         }
-        os << '{' << static_cast<char>(31);
 
-        for (const auto& cell : m_table.m_cells)
+        // Breaking the cycle evaluates the cells on and behind it again, closing it empties them again.
+        sheet.setCell(CPos("A2"), "5");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A1")), CValue(6.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue(12.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B2")), CValue(2.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B3")), CValue(1.0)));
+        sheet.setCell(CPos("A2"), "=C1");
+        sheet.recalculate();
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A1")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue()));
+        std::vector<CValue> values(2);
+        SPREADSHEET_CHECK(sheet.getValues(CPos("A1"), 1, 2, values));
+        SPREADSHEET_CHECK(equals(values[0], CValue()) && equals(values[1], CValue()));
+    }
+
+    /**
+     * @brief getNumbers reads numbers and NaN for everything else, getValues agrees with getValue.
+     */
+    void blockReads ()
+    {
+        // Column B crosses a boundary of the cached number chunks.
+        CSpreadsheet sheet;
+        for(int row = 60; row <= 70; row++)
+            sheet.setCell(CPos(2, row), "=A1*" + std::to_string(row));
+        sheet.setCell(CPos("A1"), "2");
+        sheet.setCell(CPos("B64"), "text");
+        sheet.setCell(CPos("B65"), "=B66");
+        sheet.setCell(CPos("B66"), "=B65");
+        sheet.setCell(CPos("B67"), "=1/0");
+        sheet.setCell(CPos("C61"), "-0.5");
+
+        const int w = 3, h = 12;
+        std::vector<double> numbers(w * h, 1.0);
+        SPREADSHEET_CHECK(sheet.getNumbers(CPos("A60"), w, h, numbers));
+        for(int row = 0; row < h; row++)
         {
-            if (!os)
+            for(int column = 0; column < w; column++)
             {
-                return false;
+                CPos pos(1 + column, 60 + row);
+                auto number = numbers[row * w + column];
+                auto value = sheet.getValue(pos);
+                if(std::holds_alternative<double>(value))
+                    SPREADSHEET_CHECK(number == std::get<double>(value));
+                else
+                    SPREADSHEET_CHECK(std::isnan(number));
             }
-            os << cell.first.getColumnStr() + std::to_string(cell.first.getRow()) << static_cast<char>(30) << ':' << static_cast<char>(30) << *cell.second << static_cast<char>(31);
         }
+        SPREADSHEET_CHECK(numbers[0 * w + 1] == 120.0);
+        SPREADSHEET_CHECK(numbers[10 * w + 1] == 140.0);
+        SPREADSHEET_CHECK(numbers[1 * w + 2] == -0.5);
+        SPREADSHEET_CHECK(std::isnan(numbers[4 * w + 1]) && std::isnan(numbers[5 * w + 1]) && std::isnan(numbers[7 * w + 1]));
+        SPREADSHEET_CHECK(std::isnan(numbers[11 * w + 1]));
+
+        // Changed and erased cells are read again.
+        sheet.setCell(CPos("A1"), "3");
+        sheet.setCell(CPos("B65"), "1");
+        sheet.deleteRows(70, 1);
+        SPREADSHEET_CHECK(sheet.getNumbers(CPos("A60"), w, h, numbers));
+        SPREADSHEET_CHECK(numbers[0 * w + 1] == 180.0);
+        SPREADSHEET_CHECK(numbers[5 * w + 1] == 1.0 && numbers[6 * w + 1] == 1.0);
+        SPREADSHEET_CHECK(std::isnan(numbers[10 * w + 1]));
+
+        std::vector<CValue> values(w * h);
+        SPREADSHEET_CHECK(sheet.getValues(CPos("A60"), w, h, values));
+        for(int i = 0; i < w * h; i++)
+            SPREADSHEET_CHECK(equals(values[i], sheet.getValue(CPos(1 + i % w, 60 + i / w))));
+
+        // A buffer that is too small is left alone, an empty rectangle needs no buffer.
+        std::vector<double> small(w * h - 1, 1.0);
+        SPREADSHEET_CHECK(!sheet.getNumbers(CPos("A60"), w, h, small));
+        SPREADSHEET_CHECK(std::all_of(small.begin(), small.end(), [](double number) { return number == 1.0; }));
+        std::vector<CValue> fewer(w * h - 1, CValue("x"));
+        SPREADSHEET_CHECK(!sheet.getValues(CPos("A60"), w, h, fewer));
+        SPREADSHEET_CHECK(equals(fewer.front(), CValue("x")));
+        SPREADSHEET_CHECK(sheet.getNumbers(CPos("A60"), 0, h, {}));
+        SPREADSHEET_CHECK(sheet.getValues(CPos("A60"), w, -1, {}));
+
+        // A rectangle reaching past the last row or column does not wrap around to the first ones.
+        constexpr long long last = std::numeric_limits<int32_t>::max();
+        sheet.setCell(CPos("A5"), "7");
+        sheet.setCell(CPos(1, last), "=A5*2");
+        std::vector<CValue> edge(1000, CValue("x"));
+        SPREADSHEET_CHECK(!sheet.getValues(CPos(1, last - 500), 1, 1000, edge));
+        SPREADSHEET_CHECK(std::all_of(edge.begin(), edge.end(), [](const CValue &value) { return equals(value, CValue("x")); }));
+        std::vector<double> edgeNumbers(1000, 1.0);
+        SPREADSHEET_CHECK(!sheet.getNumbers(CPos(1, last - 500), 1, 1000, edgeNumbers));
+        SPREADSHEET_CHECK(!sheet.getNumbers(CPos(last - 1, 1), 3, 1, edgeNumbers));
+        SPREADSHEET_CHECK(std::all_of(edgeNumbers.begin(), edgeNumbers.end(), [](double number) { return number == 1.0; }));
+        SPREADSHEET_CHECK(sheet.getValues(CPos(1, last - 999), 1, 1000, edge));
+        SPREADSHEET_CHECK(equals(edge.back(), CValue(14.0)) && equals(edge.front(), CValue()));
+        SPREADSHEET_CHECK(sheet.getNumbers(CPos(1, last - 999), 1, 1000, edgeNumbers));
+        SPREADSHEET_CHECK(edgeNumbers.back() == 14.0 && std::isnan(edgeNumbers.front()));
+    }
 
-        if(!(os << '}'))
-            return false;
-        return true;
+    /**
+     * @brief Inserting and deleting rows and columns moves cells and rewrites the formulas referencing them.
+     */
+    void shifts ()
+    {
+        CSpreadsheet sheet;
+        for(int row = 1; row <= 5; row++)
+            sheet.setCell(CPos(1, row), std::to_string(row));
+        sheet.setCell(CPos("B1"), "=A2+1");
+        sheet.setCell(CPos("C1"), "=SUM(A1:A5)");
+        sheet.setCell(CPos("D1"), "=SUM(A2:A3,1)");
+        sheet.setCell(CPos("E1"), "=$A$5*2");
+        sheet.setCell(CPos("F1"), "=COUNT(A3:A9)");
+        sheet.setCell(CPos("G1"), "=SUM(A4:A5)");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue(15.0)));
+        std::ostringstream base;
+        SPREADSHEET_CHECK(sheet.checkpoint(base));
+
+        // Deleted references read (0/0), ranges lose their deleted rows or become (0/0) entirely.
+        SPREADSHEET_CHECK(sheet.deleteRows(2, 2));
+        auto text = saved(sheet);
+        SPREADSHEET_CHECK(text.find("=((0.000000/0.000000)+1.000000)") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("=SUM(A1:A3)") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("=SUM((0.000000/0.000000),1.000000)") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("=($A$3*2.000000)") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("=COUNT(A2:A7)") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("=SUM(A2:A3)") != std::string::npos);
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A2")), CValue(4.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B1")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue(10.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("D1")), CValue(1.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("F1")), CValue(2.0)));
+
+        // Inserted rows inside a range grow it, the moved cells keep their values.
+        SPREADSHEET_CHECK(sheet.insertRows(2, 3));
+        text = saved(sheet);
+        SPREADSHEET_CHECK(text.find("=SUM(A1:A6)") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("=($A$6*2.000000)") != std::string::npos);
+        SPREADSHEET_CHECK(text.find("=SUM(A5:A6)") != std::string::npos);
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A5")), CValue(4.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("A2")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("E1")), CValue(10.0)));
+        sheet.setCell(CPos("A3"), "100");
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("C1")), CValue(110.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("G1")), CValue(9.0)));
+
+        // Columns behave the same, a moved formula follows the cells it references.
+        text = saved(sheet);
+        SPREADSHEET_CHECK(sheet.insertColumns(1, 2));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("E1")), CValue(110.0)));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("G1")), CValue(10.0)));
+        SPREADSHEET_CHECK(saved(sheet).find("=($C$6*2.000000)") != std::string::npos);
+        SPREADSHEET_CHECK(sheet.deleteColumns(1, 2));
+        SPREADSHEET_CHECK(saved(sheet) == text);
+        SPREADSHEET_CHECK(sheet.deleteColumns(1, 1));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("B1")), CValue()));
+        SPREADSHEET_CHECK(equals(sheet.getValue(CPos("D1")), CValue()));
+
+        // Invalid arguments and moves past the last row leave the sheet as it is.
+        CSpreadsheet edge;
+        edge.setCell(CPos("A1"), "=A2147483600");
+        edge.setCell(CPos("B5"), "1");
+        auto before = saved(edge);
+        SPREADSHEET_CHECK(!edge.insertRows(10, 100));
+        SPREADSHEET_CHECK(!edge.insertRows(-1, 1));
+        SPREADSHEET_CHECK(!edge.deleteRows(1, 0));
+        SPREADSHEET_CHECK(!edge.deleteColumns(-5, 2));
+        SPREADSHEET_CHECK(saved(edge) == before);
+        SPREADSHEET_CHECK(edge.insertRows(10, 47));
+        SPREADSHEET_CHECK(saved(edge).find("=A2147483647") != std::string::npos);
+        SPREADSHEET_CHECK(edge.insertColumns(2, 1));
+        SPREADSHEET_CHECK(equals(edge.getValue(CPos("C5")), CValue(1.0)));
+
+        // Only the moved cells and the cells referencing them are journaled.
+        CSpreadsheet large;
+        for(int row = 1; row <= 1000; row++)
+            large.setCell(CPos(1, row), "=" + std::to_string(row) + "*1");
+        large.setCell(CPos("C1"), "=A999");
+        std::ostringstream checkpoint;
+        SPREADSHEET_CHECK(large.checkpoint(checkpoint));
+        SPREADSHEET_CHECK(large.insertRows(998, 1));
+        std::ostringstream journal;
+        SPREADSHEET_CHECK(large.saveJournal(journal));
+        for(const char *pos : {"A998", "A999", "A1000", "A1001", "C1"})
+            SPREADSHEET_CHECK(journal.str().find(std::string(pos) + static_cast<char>(30)) != std::string::npos);
+        SPREADSHEET_CHECK(journal.str().find(std::string("A997") + static_cast<char>(30)) == std::string::npos);
+        SPREADSHEET_CHECK(journal.str().find(std::string("A1") + static_cast<char>(30)) == std::string::npos);
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("A1000")), CValue(999.0)));
+        SPREADSHEET_CHECK(equals(large.getValue(CPos("C1")), CValue(999.0)));
     }
-    bool CSpreadsheet::setCell (CPos pos, std::string contents)
+
+    /**
+     * @brief Journal blocks are replayed in order and a torn or damaged block is not applied.
+     */
+    void journal ()
     {
-        try
+        CSpreadsheet sheet;
+        sheet.setCell(CPos("A1"), "1");
+        sheet.setCell(CPos("B1"), "=A1*10");
+        std::ostringstream base, journal;
+        SPREADSHEET_CHECK(sheet.checkpoint(base));
+        sheet.setCell(CPos("A1"), "2");
+        sheet.setCell(CPos("C1"), "text");
+        SPREADSHEET_CHECK(sheet.saveJournal(journal));
+        sheet.copyRect(CPos("C1"), CPos("Z99"));
+        sheet.setCell(CPos("A2"), "=A1+B1");
+        SPREADSHEET_CHECK(sheet.saveJournal(journal));
+        auto good = journal.str();
+        sheet.setCell(CPos("A1"), "3");
+        sheet.setCell(CPos("A3"), "last");
+        SPREADSHEET_CHECK(sheet.saveJournal(journal));
+        auto full = journal.str();
+
+        auto replay = [&base](const std::string &text, bool complete, std::streamoff end)
         {
-            bool isExp = false;
-            if(contents[0] == '=')
-                isExp = true;
-            CBuilder builder(&m_table, isExp);
-            parseExpression(contents, builder);
-            builder.getRoot(m_table.m_cells[pos], isExp);
-        }
-        catch (const std::invalid_argument &e)
+            std::istringstream baseStream(base.str()), journalStream(text);
+            CSpreadsheet copy;
+            SPREADSHEET_CHECK(copy.load(baseStream));
+            SPREADSHEET_CHECK(copy.loadJournal(journalStream) == complete);
+            SPREADSHEET_CHECK(journalStream.tellg() == std::istream::pos_type(end));
+            return copy;
+        };
+        auto checkGood = [](CSpreadsheet &copy)
         {
-            std::cout << e.what();
-            return false;
-        }
-        return true;
-    }
-    CValue CSpreadsheet::getValue (CPos pos)
-    {
-        auto cell = m_table.m_cells.find(pos);
-        if(cell == m_table.m_cells.end())
+            SPREADSHEET_CHECK(equals(copy.getValue(CPos("A1")), CValue(2.0)));
+            SPREADSHEET_CHECK(equals(copy.getValue(CPos("A2")), CValue(22.0)));
+            SPREADSHEET_CHECK(equals(copy.getValue(CPos("C1")), CValue()));
+            SPREADSHEET_CHECK(equals(copy.getValue(CPos("A3")), CValue()));
+        };
+
+        auto complete = replay(full, true, -1);
+        SPREADSHEET_CHECK(equals(complete.getValue(CPos("A2")), CValue(33.0)));
+        SPREADSHEET_CHECK(equals(complete.getValue(CPos("A3")), CValue("last")));
+        SPREADSHEET_CHECK(equals(complete.getValue(CPos("C1")), CValue()));
+
+        // Every cut through the last block leaves the stream at its start.
+        auto goodEnd = static_cast<std::streamoff>(good.size());
+        for(size_t size = good.size() + 1; size < full.size(); size++)
         {
-            return CValue{};
+            auto copy = replay(full.substr(0, size), false, goodEnd);
+            checkGood(copy);
         }
-        std::map<CPos, bool , CPosComparator> visited;
-        visited[pos] = true;
-        if(cell->second->hasCycle(visited))
-            return CValue {};
-        auto test = cell->second->evaluate();
-
-        return cell->second->evaluate();
-    }
-    void CSpreadsheet::copyRect (CPos dst, CPos src, int w, int h)
-    {
-        std::map<CPos, std::shared_ptr<ASTNode>, CPosComparator> temp;
 
-        for(auto y = 0; y < h; y++)
+        // A block appended behind a torn one is not merged into it.
+        auto torn = full.substr(0, full.size() - 4);
         {
-            for(auto x = 0; x < w; x++)
-            {
-                std::pair<long long, long long> offset = std::make_pair(x,y);
-                CPos toCopy = src + offset;
-                if(auto found = m_table.m_cells.find(toCopy); found == m_table.m_cells.end())
-                    continue;
-                temp[toCopy] = m_table.m_cells[toCopy]->m_left;
-                temp[toCopy]->isExpression = m_table.m_cells[toCopy]->isExpression;
-            }
+            std::istringstream baseStream(base.str()), journalStream(torn);
+            CSpreadsheet copy;
+            SPREADSHEET_CHECK(copy.load(baseStream));
+            SPREADSHEET_CHECK(copy.loadJournal(journalStream) == false);
+            copy.setCell(CPos("D1"), "appended");
+            std::ostringstream appended;
+            SPREADSHEET_CHECK(copy.saveJournal(appended));
+            torn += appended.str();
+
+            auto damaged = replay(torn, false, goodEnd);
+            checkGood(damaged);
+            SPREADSHEET_CHECK(equals(damaged.getValue(CPos("D1")), CValue()));
+
+            // Cut off at the torn block, the appended block is applied.
+            auto repaired = replay(good + appended.str(), true, -1);
+            checkGood(repaired);
+            SPREADSHEET_CHECK(equals(repaired.getValue(CPos("D1")), CValue("appended")));
         }
-        for(int y = 0; y < h; y++)
-        {
-            for(int x = 0; x < w; x++)
-            {
-                std::pair<long long, long long> offset = std::make_pair(x,y);
-                auto from = src + offset;
-                auto to = dst + offset;
-
-                if(auto found = temp.find(from); found == temp.end())
-                {
-                    if(auto ptr = m_table.m_cells.find(to); ptr != m_table.m_cells.end())
-                        m_table.m_cells.erase(ptr);
-                    continue;
-                }
-                if(m_table.m_cells[to] == nullptr)
-                    m_table.m_cells[to] = std::make_shared<ASTNodeRoot>();
 
-                m_table.m_cells[to]->m_left = temp[from]->deepCopy(m_table.m_cells);
-                m_table.m_cells[to]->isExpression = temp[from]->isExpression;
+        // Cells loaded into a journaled sheet, in either format, are journaled like other changes.
+        {
+            CSpreadsheet loading = sheet, text, binary;
+            text.setCell(CPos("A1"), "5");
+            text.setCell(CPos("E5"), "=A1*3");
+            binary.setCell(CPos("F6"), "=E5+1");
+            binary.setCell(CPos("B1"), "binary");
+            std::ostringstream loadingBase, loadingJournal, textStream, binaryStream;
+            SPREADSHEET_CHECK(text.save(textStream) && binary.saveBinary(binaryStream));
+            SPREADSHEET_CHECK(loading.checkpoint(loadingBase));
+            std::istringstream textInput(textStream.str()), binaryInput(binaryStream.str());
+            SPREADSHEET_CHECK(loading.load(textInput));
+            SPREADSHEET_CHECK(loading.saveJournal(loadingJournal));
+            SPREADSHEET_CHECK(loading.load(binaryInput));
+            SPREADSHEET_CHECK(loading.saveJournal(loadingJournal));
+            std::istringstream baseStream(loadingBase.str()), journalStream(loadingJournal.str());
+            CSpreadsheet copy;
+            SPREADSHEET_CHECK(copy.load(baseStream) && copy.loadJournal(journalStream));
+            SPREADSHEET_CHECK(saved(copy) == saved(loading));
+            SPREADSHEET_CHECK(equals(copy.getValue(CPos("F6")), CValue(16.0)));
+            SPREADSHEET_CHECK(equals(copy.getValue(CPos("B1")), CValue("binary")));
+        }
 
-                auto relativeOffset = std::make_pair(to.getColumn() - from.getColumn(), to.getRow() - from.getRow());
-                m_table.m_cells[to]->moveRelativelyBy(relativeOffset);
-            }
+        // An assigned sheet needs a new checkpoint before it journals again.
+        {
+            CSpreadsheet other;
+            other.setCell(CPos("B2"), "=A1+5");
+            auto assigned = sheet;
+            std::ostringstream assignedBase, assignedJournal;
+            SPREADSHEET_CHECK(assigned.checkpoint(assignedBase));
+            assigned = other;
+            assigned.setCell(CPos("C3"), "3");
+            SPREADSHEET_CHECK(!assigned.saveJournal(assignedJournal));
+            assignedBase.str("");
+            SPREADSHEET_CHECK(assigned.checkpoint(assignedBase));
+            assigned.setCell(CPos("A1"), "1");
+            SPREADSHEET_CHECK(assigned.saveJournal(assignedJournal));
+            std::istringstream baseStream(assignedBase.str()), journalStream(assignedJournal.str());
+            CSpreadsheet copy;
+            SPREADSHEET_CHECK(copy.load(baseStream) && copy.loadJournal(journalStream));
+            SPREADSHEET_CHECK(saved(copy) == saved(assigned));
+            SPREADSHEET_CHECK(equals(copy.getValue(CPos("B2")), CValue(6.0)));
         }
+
+        // A changed byte fails the checksum.
+        auto changed = full;
+        auto at = changed.rfind("last");
+        SPREADSHEET_CHECK(at != std::string::npos);
+        changed[at] = 'L';
+        auto copy = replay(changed, false, goodEnd);
+        checkGood(copy);
+
+        // A damaged length does not read past the stream.
+        auto longer = good + "999999999999" + full.substr(full.find(static_cast<char>(30), good.size()));
+        copy = replay(longer, false, goodEnd);
+        checkGood(copy);
     }
-    void CSpreadsheet::print() const
+}
+
+/**
+ * @brief Run the checks.
+ */
+int main ()
+{
+    tests::positions();
+    tests::rangeFunctions();
+    tests::textFormat();
+    tests::binaryFormat();
+    tests::constantFolding();
+    tests::batchWrites();
+    tests::cycles();
+    tests::blockReads();
+    tests::shifts();
+    tests::journal();
+    if(tests::failures != 0)
     {
-        for(const auto& cell : m_table.m_cells)
-        {
-            if(cell.second->m_left)
-                std::cout << cell.first.getColumnStr() << cell.first.getRow() << ":" << *cell.second << std::endl;
-        }
+        std::cerr << tests::failures << " checks failed" << std::endl;
+        return 1;
     }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
+#endif